@@ -39,44 +39,372 @@ This involves making the rate of creation slightly greater than the rate of fill
 
 */
 
+#if defined(__linux) && !defined(_GNU_SOURCE)
+#define _GNU_SOURCE // For sched_setaffinity.
+#endif
+
 #include <stdio.h>
 #include <stdlib.h>
+#include <stdarg.h>
+#include <string.h>
 #include <stdbool.h>
+#include <limits.h>
 #include <math.h>
 #include <time.h>
+
+#if defined(_WIN32)
 #include <corecrt_math.h>
 #include <conio.h>
+#include <intrin.h>
+#include <windows.h>
+#endif
+#ifdef __linux
+#include <dlfcn.h>
+#include <fcntl.h>
+#include <sched.h>
+#include <unistd.h>
+#include <linux/perf_event.h>
+#include <sys/mman.h>
+#include <sys/stat.h>
+#include <poll.h>
+#include <sys/socket.h>
+#include <netinet/in.h>
+#include <sys/syscall.h>
+#include <sys/wait.h>
+#include <termios.h>
+#include <pthread.h>
+#endif
+
+#include "strategy.h"
 
 typedef unsigned long long u64;
 typedef unsigned int u32;
 
-// A limit order waiting to be filled.
-typedef struct {
-	u32 size;
-	u32 p;
-	u64 expirationTime; // The time at which this order gets deleted.
-	struct limitOrder* next; // Next order at the exact same price (singly-linked list).
-	bool user; // Whether this limit order was created by the user.
-} limitOrder;
+// Stores that publish a pointer to readers on other threads, and the loads that read it. A reader that sees a published pointer
+// also sees everything written before it was published. On Windows this relies on x64 ordering and volatile having acquire semantics.
+#if defined(_WIN32)
+#define publish(dst, value) do { _ReadWriteBarrier(); *(void* volatile*)&(dst) = (void*)(value); } while (0)
+#define readPublished(src) (*(void* volatile*)&(src))
+#define storeRelease(dst, value) do { _ReadWriteBarrier(); *(volatile u64*)&(dst) = (value); } while (0)
+#define loadAcquire(src) (*(volatile u64*)&(src))
+#define memoryFence() MemoryBarrier()
+#define storeRelaxed(dst, value) (*(volatile u64*)&(dst) = (value))
+#define loadRelaxed(src) (*(volatile u64*)&(src))
+#else
+#define publish(dst, value) __atomic_store_n(&(dst), (value), __ATOMIC_RELEASE)
+#define readPublished(src) __atomic_load_n(&(src), __ATOMIC_ACQUIRE)
+#define storeRelease(dst, value) __atomic_store_n(&(dst), (value), __ATOMIC_RELEASE)
+#define loadAcquire(src) __atomic_load_n(&(src), __ATOMIC_ACQUIRE)
+#define memoryFence() __atomic_thread_fence(__ATOMIC_SEQ_CST)
+#define storeRelaxed(dst, value) __atomic_store_n(&(dst), (value), __ATOMIC_RELAXED)
+#define loadRelaxed(src) __atomic_load_n(&(src), __ATOMIC_RELAXED)
+#endif
+
+// Replace *dst with desired if it still holds *expected. Otherwise, load what it holds into *expected and return 0.
+bool compareAndSwap(u64* dst, u64* expected, u64 desired) {
+#if defined(_WIN32)
+	u64 old = (u64)InterlockedCompareExchange64((volatile LONG64*)dst, (LONG64)desired, (LONG64)*expected);
+	if (old == *expected) return 1;
+	*expected = old;
+	return 0;
+#else
+	return __atomic_compare_exchange_n(dst, expected, desired, 1, __ATOMIC_ACQ_REL, __ATOMIC_ACQUIRE);
+#endif
+}
 
-// Free memory to create orders and commands from. These point to locations in the original blocks which are not stored.
+// Add v to *dst and return what it held before.
+u64 fetchAdd(u64* dst, u64 v) {
+#if defined(_WIN32)
+	return (u64)InterlockedExchangeAdd64((volatile LONG64*)dst, (LONG64)v);
+#else
+	return __atomic_fetch_add(dst, v, __ATOMIC_ACQ_REL);
+#endif
+}
+
+// limitOrder, a limit order waiting to be filled, is defined in strategy.h so that plugins can read the book directly.
+
+// Free memory to create orders and commands from. These point to locations in the original block.
+// The pool is only reserved address space at first. Orders are handed out from the high-water mark once the free list runs out,
+// and memory is committed a block at a time as the mark rises, so a large poolSize costs nothing until it is used.
+limitOrder* limitOrderPool;
 limitOrder** freeLimitOrders;
 int numFreeLimitOrders = 0;
-int poolSize = 1000000;
+int poolSize = 1000000; // Most orders that can rest at once. Only the orders actually used take up memory.
+int poolHighWater = 0; // Orders from here up have never been used.
+int poolCommitted = 0; // Orders from here up have not been committed yet.
+int poolPagesMode = 0; // The page size the pool was allocated with.
+#define POOL_COMMIT_ORDERS 65536
+limitOrder* freeChain = NULL; // Whole price levels handed back at once by a sweep, linked through next. Used once the free list is empty.
+u64* poolBitmap; // One bit per order below the high-water mark. 0 means the order is free and owned by the compactor rather than by a free list.
+int numBitmapFree = 0; // How many bits below the high-water mark are 0.
+u32 bitmapCursor = 0; // No bit below this one is 0.
+
+// State of the pool compactor, which moves each price level's orders into consecutive slots of the pool a slice at a time.
+// A pass first takes every order on the free list and free chain into the bitmap, so that runs of free slots can be found,
+// then moves the levels in price order into the first run big enough for them, or above the high-water mark if there is none.
+bool compactActive = 0;
+int compactTakeoverLeft = 0; // Orders still to be taken from the free list at the start of the pass.
+u32 compactPrice = 0; // The level being moved.
+bool compactLevelActive = 0;
+limitOrder* compactPrev = NULL; // The last order of the level moved so far, or NULL if none has been moved yet.
+bool compactLost = 0; // The last order moved left the book, so the rest of the level is skipped.
+u32 compactRunNext = 0; // The next slot to move an order into.
+u32 compactRunEnd = 0;
+u32 compactSearch = 0; // Runs of free slots are searched for from here on.
+u64 nextCompaction = 0;
+
+// Epoch-based reclamation, so that threads other than the matching loop can walk the book while it changes.
+// A reader announces the epoch it saw when it starts reading and clears it when done. Orders that leave the book wait in the bag of
+// the epoch they left in, and the epoch only moves on once every reader has caught up with it. Two epochs later, no reader
+// can still be looking at them, so they go back on the free list. Readers only ever see orders in the continuous book.
+#define MAX_BOOK_READERS 16
+#define LIMBO_SEGMENTS 4096
+typedef struct {
+	u64 epoch; // The epoch the reader started reading in, or 0 if it isn't reading.
+	u64 passes;
+	u64 depth; // Result of the reader's last walk.
+	char padding[40]; // Keep each reader on its own cache line.
+} bookReader;
+bookReader bookReaders[MAX_BOOK_READERS];
+int numBookReaders = 0;
+bool epochReclamation = 0; // Whether orders leaving the book go through the limbo bags instead of straight to the free list.
+u64 globalEpoch = 1;
+limitOrder** limboOrders[3]; // The orders retired in each of the last three epochs, by epoch % 3.
+int numLimboOrders[3];
+limitOrder* limboSegmentHeads[3][LIMBO_SEGMENTS]; // Whole levels retired at once.
+limitOrder* limboSegmentTails[3][LIMBO_SEGMENTS];
+int numLimboSegments[3];
+volatile bool stopBookReaders = 0;
+#if defined(_WIN32)
+HANDLE bookReaderHandles[MAX_BOOK_READERS];
+#else
+pthread_t bookReaderHandles[MAX_BOOK_READERS];
+#endif
 
 // Current state of the order book.
 #define NUM_PRICES 100000 // Min price is $0.00, max price is $999.99.
-limitOrder* limitOrderHead[NUM_PRICES]; // Singly-linked list: the first limit order at this price. Buy/sell depends solely on price's relation to bid and ask.
+limitOrder** limitOrderHead; // NUM_PRICES entries. Singly-linked list: the first limit order at this price. Buy/sell depends solely on price's relation to bid and ask.
 u32 bid = 0; // Will be the current highest limit buy price after updating.
 u32 ask = UINT_MAX; // Will be the current lowest limit sell price after updating.
 
+// Running totals for each price level in the continuous book, so that whole levels can be added to, skipped or consumed without walking them.
+limitOrder* levelTail[NUM_PRICES]; // The last limit order at this price.
+u32 levelVolume[NUM_PRICES]; // Shares resting at this price, including orders that have expired but not been removed yet.
+u32 levelUserOrders[NUM_PRICES]; // How many of the orders at this price are the user's.
+u64 levelMinExpiration[NUM_PRICES]; // No order at this price expires before this time. It may be earlier than the true minimum.
+u32 levelOrders[NUM_PRICES]; // How many orders are at this price.
+
+// Fingerprint of the continuous book, kept up to date as it changes so that two runs can be compared cheaply.
+// Every order contributes a key made from its price, id, size and the id of the order in front of it (0 at the head of the queue),
+// and the fingerprint is the XOR of all of them. The ids of neighbours fix every order's place in its queue, so reordering a
+// queue changes the fingerprint, yet adding, filling or removing an order only changes the keys of that order and the one behind it.
+u64 levelHash[NUM_PRICES]; // XOR of the keys of the orders at this price.
+u64 bookHash = 0;
+u32 nextOrderId = 0;
+
+// Mix the bits of x thoroughly (the finalizer of SplitMix64).
+u64 mix64(u64 x) {
+	x = (x ^ (x >> 30)) * (u64)0xbf58476d1ce4e5b9;
+	x = (x ^ (x >> 27)) * (u64)0x94d049bb133111eb;
+	return x ^ (x >> 31);
+}
+
+// Key of an order at price p with the given size, behind the order numbered prevId.
+u64 orderKey(u32 p, u32 id, u32 size, u32 prevId) {
+	return mix64(mix64(((u64)p << 32) | id) ^ (((u64)size << 32) | prevId));
+}
+
+// Add or remove the key of an order at price p with the given size, behind the order numbered prevId.
+void hashOrder(u32 p, u32 id, u32 size, u32 prevId) {
+	u64 key = orderKey(p, id, size, prevId);
+	levelHash[p] ^= key;
+	bookHash ^= key;
+}
+
+// Trading phases. During an auction, orders accumulate without matching until the book is uncrossed at a single price.
+enum { PHASE_CONTINUOUS, PHASE_OPENING_AUCTION, PHASE_CLOSING_AUCTION, PHASE_CLOSED };
+char* phaseText[4] = { "Continuous", "Opening auction", "Closing auction", "Closed" };
+int marketPhase = PHASE_CONTINUOUS;
+u64 sessionStartTime = 0;
+
+// Orders entered during an auction, newest first. They are put into time priority when the book is uncrossed.
+limitOrder* auctionBuyHead[NUM_PRICES];
+limitOrder* auctionSellHead[NUM_PRICES];
+limitOrder* auctionMarketBuyHead = NULL; // Market orders have no price and are filled before any limit order.
+limitOrder* auctionMarketSellHead = NULL;
+u32 auctionMinPrice = UINT_MAX; // Lowest price of a limit order entered during the auction.
+u32 auctionMaxPrice = 0; // Highest price of a limit order entered during the auction.
+u32 indicativePrice = 0; // The price the auction would uncross at right now.
+u32 indicativeVolume = 0;
+u32 lastUncrossPrice = 0;
+u32 lastUncrossVolume = 0;
+
+// Depth used to find the uncrossing price, indexed by price and only valid inside the range being uncrossed.
+u32 auctionBuyLevel[NUM_PRICES]; // Shares bid at exactly this price.
+u32 auctionSellLevel[NUM_PRICES]; // Shares offered at exactly this price.
+u32 auctionBuyDepth[NUM_PRICES]; // Shares willing to buy at this price, including market orders.
+u32 auctionSellDepth[NUM_PRICES]; // Shares willing to sell at this price, including market orders.
+u64 auctionKey[NUM_PRICES]; // Executable shares in the high half and the complement of the imbalance in the low half.
+
 #define MAX_NUM_USER_LIMIT_ORDERS 100
 int numUserLimitOrders = 0;
 limitOrder** userLimitOrders = NULL;
 
+// A message on its way to the exchange. Participants' limit prices are stored as distances from the other side of the book,
+// so that they are resolved against the book as it is when the message arrives.
+typedef struct orderMessage {
+	u64 arrivalTime;
+	u64 lifespan; // How long a participant's limit order lives after it arrives.
+	u32 size;
+	u32 distance; // How far a participant's limit order is placed from the opposite side of the book.
+	u32 crossDistance; // How far a participant's limit order is placed through the opposite side during an auction.
+	u32 price; // Price of a strategy's limit order. The user's own limit orders join the bid or ask when they arrive.
+	u32 referencePrice; // Midpoint when one of the user's orders was sent, for measuring slippage.
+	int type;
+	bool user;
+	struct orderMessage* next;
+} orderMessage;
+
+enum { MESSAGE_MARKET_BUY, MESSAGE_MARKET_SELL, MESSAGE_LIMIT_BUY, MESSAGE_LIMIT_SELL, MESSAGE_CANCEL_ALL };
+#define PRICE_AT_TOUCH UINT_MAX
+
+// Timing wheel of messages in flight. Each slot is a FIFO list of the messages arriving in one tick within the next rotation.
+// Ticks count from the start of the session, so that runs with the same seed deliver messages identically.
+#define WHEEL_SLOTS 65536
+#define MESSAGE_BLOCK_SIZE 65536
+orderMessage* wheelHead[WHEEL_SLOTS];
+orderMessage* wheelTail[WHEEL_SLOTS];
+u64 wheelOccupied[WHEEL_SLOTS / 64]; // One bit per slot that has messages in it.
+u64 wheelTick = 0; // Every tick before this one has been delivered.
+orderMessage* wheelOverflow = NULL; // Messages arriving after the current rotation.
+orderMessage* freeMessages = NULL;
+int numMessagesInFlight = 0;
+u64 gatewayFreeTime = 0; // When the gateway finishes the last message it was given.
+
+// Journals start with a header and then hold one record per participant order, in the order they were sent.
+// Every journalHashInterval orders, a checkpoint record holds the book's fingerprint (in lifespan) after that order was sent.
+#define JOURNAL_MAGIC (u64)0x324c4e524a4b4f42
+#define JOURNAL_CHECKPOINT 0xffffffff
+
+// The settings that decide how a journal's orders play out, recorded with it and put back in place while it is replayed.
+typedef struct {
+	u64 latencyUserNS, latencyParticipantNS, latencyJitterNS, gatewayServiceNS, wheelTickNS;
+	u64 openingAuctionLengthNS, closingAuctionStartNS, closingAuctionLengthNS;
+	u64 riskMaxNotional;
+	u64 compactionIntervalNS;
+	u32 riskMaxOrderSize, riskPriceBand, riskMaxMessagesPerSecond;
+	int riskMaxPosition;
+	int compactionSliceOrders;
+	u32 initialBidMin, initialBidMax, initialSpreadMin, initialSpreadMax;
+	u32 uniformLatencyJitter, realisticUserMarketOrders, fillTiesInStackOrder;
+} journalSettings;
+
+typedef struct {
+	u64 magic;
+	u64 seed; // Recreates the initial book.
+	u64 startingTime;
+	u64 frameLengthNS;
+	journalSettings settings;
+} journalHeader;
+
+typedef struct {
+	u64 t;
+	u64 lifespan;
+	u32 size;
+	u32 distance;
+	u32 crossDistance;
+	u32 type;
+} journalRecord;
+
+FILE* journalFile = NULL;
+int journalDescriptor = -1; // The journal's file descriptor, for measuring how much of it is still buffered.
+u64 sessionSeed = 0;
+u64 sessionWallStart = 0;
+u64 numEvents = 0; // Participant orders processed this session.
+
+// What the main loop counts for the metrics endpoint. Only the main loop writes these, with relaxed stores, and the metrics thread
+// reads them with relaxed loads. They sit on cache lines of their own, so that scraping never slows the main loop down. The other
+// threads count in their own padded slots already: generatedPositions, bookReaders and ingressProducers.
+#define LATENCY_BUCKETS 48
+typedef struct {
+	u64 events; // Participant orders processed since the program started.
+	u64 frames;
+	u64 frameOverruns; // Printed frames for which the main loop couldn't keep up with the clock.
+	u64 journalBytes; // Bytes handed to the journal's stream.
+	u64 restingOrders; // Orders in the continuous book at the last frame.
+	u64 poolHighWater; // Orders of the pool ever used, at the last frame.
+	u64 poolFree; // Orders on the free list and in the compactor's bitmap, at the last frame.
+	u64 bid;
+	u64 ask;
+	u64 latencySum; // Nanoseconds spent processing participant orders, while the metrics endpoint runs.
+	u64 latency[LATENCY_BUCKETS]; // Participant orders by processing time. Bucket b holds times under 2^b ns and at least half that.
+} matchingMetrics;
+struct {
+	char padding[64];
+	matchingMetrics m;
+	char padding2[64];
+} metrics;
+
+// Add n to one of the main loop's metrics.
+void countMetric(u64* counter, u64 n) {
+	storeRelaxed(*counter, *counter + n);
+}
+
+// A scripted user action, at a time relative to the start of the session.
+typedef struct {
+	u64 t;
+	int action;
+	int field; // Which size a size edit changes, in the order they are displayed.
+	u32 value;
+} userAction;
+
+enum { ACTION_MARKET_BUY, ACTION_MARKET_SELL, ACTION_LIMIT_BUY, ACTION_LIMIT_SELL, ACTION_SIZE, ACTION_CANCEL_ALL };
+userAction* userScript = NULL;
+int numUserScriptActions = 0;
+int nextUserScriptAction = 0;
+
 int balance = 0;
 int sharesOpen = 0;
 
+// Counters maintained incrementally so that every pre-trade risk check is constant time.
+int userOpenBuyShares = 0; // Shares remaining in the user's resting limit buys.
+int userOpenSellShares = 0; // Shares remaining in the user's resting limit sells.
+int userInFlightBuyShares = 0; // Shares in the user's buys on their way to the exchange.
+int userInFlightSellShares = 0; // Shares in the user's sells on their way to the exchange.
+int userAuctionBuyShares = 0; // Shares in the user's market buys waiting for the auction to uncross.
+int userAuctionSellShares = 0; // Shares in the user's market sells waiting for the auction to uncross.
+u64 riskWindowStart = 0; // Start of the current one-second message-rate window.
+u32 riskWindowMessages = 0; // Number of orders accepted in the current window.
+u64 userSharesSent = 0; // Shares in the user's orders that reached the gateway.
+u64 userSharesTraded = 0;
+long long userSlippage = 0; // Cents the user's market orders paid beyond the midpoint when they were sent.
+u64 userMarketSharesTraded = 0; // Shares in the market orders userSlippage was measured over.
+int numRiskRejects = 0;
+int lastRiskReject = 0;
+
+// Reasons an order can be rejected by the pre-trade risk checks.
+enum { RISK_OK, RISK_ORDER_SIZE, RISK_NOTIONAL, RISK_PRICE_BAND, RISK_POSITION, RISK_MESSAGE_RATE };
+char* riskRejectText[6] = { "None", "Order size", "Notional", "Price band", "Position", "Message rate" };
+
+u64 currentTime = 0; // The simulated time of the event being processed.
+
+// The loaded strategy plugin, if any, and what it has been given.
+bool strategyLoaded = 0;
+strategyCallbacks strategy;
+bookView strategyView;
+strategyApi strategyFunctions;
+u64 nextStrategyTimer = 0;
+bool userAggressor = 0; // Whether the market order being executed is the user's.
+u32 lastNotifiedBid = 0;
+u32 lastNotifiedAsk = 0;
+
+// Orders the strategy sent from inside a callback. They are sent once the event being processed is finished.
+#define MAX_PENDING_STRATEGY_ORDERS 1024
+orderMessage pendingStrategyOrders[MAX_PENDING_STRATEGY_ORDERS];
+int numPendingStrategyOrders = 0;
+int pendingStrategyBuyShares = 0; // Shares in the queued buys, counted against the position limit until they are sent.
+int pendingStrategySellShares = 0;
+
 bool userEditing = 0;
 u32 userEditingNumber = 0;
 int userSelected = 0;
@@ -88,10 +416,23 @@ double averageLimitOrderSize = 10.0;
 double averageLimitOrderLifespanNS = 100.0 * 1e9; // How long before a limit order gets deleted.
 double averageLimitOrderDistance = 3.0; // Average number of cents a limit buy is below the ask or a limit sell is above the bid.
 double marketOrderProbability = 0.5; // Probability of a participant choosing a market order instead of a limit order.
+
+// Histogram files to draw each quantity from instead of the exponential distribution with the average above. NULL keeps the average.
+// Each line holds a value and its weight, such as "100 35.5". Empty lines and lines starting with # are ignored.
+enum { QUANTITY_ARRIVAL, QUANTITY_MARKET_SIZE, QUANTITY_LIMIT_SIZE, QUANTITY_LIFESPAN, QUANTITY_DISTANCE, NUM_QUANTITIES };
+char* histogramPaths[NUM_QUANTITIES] = {
+	NULL, // Time between participants' orders, in nanoseconds.
+	NULL, // Market order size.
+	NULL, // Limit order size.
+	NULL, // Limit order lifespan, in nanoseconds.
+	NULL, // Limit order distance from the other side of the book, in cents.
+};
 int numOrderBookLines = 19; // The height of the order book as displayed in the console.
 
 // Other settings.
-u64 frameLengthNS = 100000000;
+u64 frameLengthNS = 100000000; // Simulated time between two updates of the whole book, and wall time between two prints of it.
+u64 rewindBufferBytes = 32 * 1024 * 1024; // Memory for looking back at earlier frames while paused. 0 turns rewinding off.
+int rewindKeyframeInterval = 50; // Frames between two full pictures of the book in the rewind buffer.
 u32 initialBidMin = 500;
 u32 initialBidMax = 500;
 u32 initialSpreadMin = 1;
@@ -102,6 +443,58 @@ u32 userMarketBuySize = 100;
 u32 userMarketSellSize = 100;
 bool realisticUserMarketOrders = 1;
 bool fillTiesInStackOrder = 0;
+char* strategyPluginPath = NULL; // Shared library to load as a strategy trading for the user.
+bool runBenchmarks = 0; // Run the benchmark suite and exit instead of starting the simulation.
+u64 seed = 0; // Seed for the participants' orders. 0 seeds from the clock.
+char* userScriptPath = NULL; // File of timestamped user actions, applied along with the keyboard. See loadUserScript.
+bool headless = 0; // Run without rendering, keyboard or waiting for the clock, then print a summary.
+u64 headlessDurationNS = 60000000000; // How much simulated time a headless run covers.
+char* journalPath = NULL; // File to record the participants' orders to, so that the session can be replayed.
+int journalHashInterval = 1000; // Orders between fingerprints of the book in the journal. 0 for none.
+char* verifyJournalPath = NULL; // Journal to replay, checking the book against every fingerprint in it. The program then exits.
+char* compareJournalPaths[2] = { NULL, NULL }; // Two journals to compare, reporting where they first differ. The program then exits.
+char* backtestListPath = NULL; // File listing one journal per line. The strategy is backtested over each of them and the program exits.
+int backtestWorkers = 0; // How many journals are replayed at once. 0 uses every core.
+u32 monteCarloSeeds = 0; // Headless sessions to run from consecutive seeds at each parameter point before exiting. 0 runs the simulation.
+u64 monteCarloFirstSeed = 1;
+char* monteCarloPointsPath = NULL; // File of parameter points, one per line. NULL runs only the settings in this file. See loadMonteCarloPoints.
+int monteCarloWorkers = 0; // Worker processes running sessions at once. 0 uses every core.
+u32 monteCarloChunk = 16; // Seeds handed to a worker at a time.
+int monteCarloRetries = 2; // How many times a session that crashed its worker is run again before it is counted as failed.
+u64 differentialEvents = 0; // Events in each stream checked against the reference book. 0 runs the simulation. See runDifferential.
+u32 differentialSeeds = 1; // Streams to check, from consecutive seeds.
+u64 differentialFirstSeed = 1;
+int differentialWorkers = 0; // Worker processes checking streams at once. 0 uses every core.
+int metricsPort = 0; // Serve metrics in Prometheus' text format at http://127.0.0.1:metricsPort/metrics. 0 serves none.
+int matchingCPU = -1; // CPU to pin the main loop to. It also reads the keyboard and renders, since those run on the same thread. -1 leaves it unpinned.
+int workerFirstCPU = -1; // Backtest workers are pinned to consecutive CPUs starting here. -1 leaves them unpinned.
+bool lockMemory = 0; // Lock every page of the process into RAM so that trading never waits on the page file.
+bool prefaultPool = 0; // Touch every page of the order pool during setup instead of the first time each order is used.
+int hugePages = 0; // Back the order pool and price levels with 2 MB pages to cut TLB misses. See HUGE_PAGES_NONE.
+u64 compactionIntervalNS = 0; // How often a pass of the pool compactor starts, in simulated time. 0 never compacts.
+int compactionSliceOrders = 256; // Most orders the compactor handles between two events.
+bool pipelineGeneration = 0; // Draw the participants' orders on a second thread ahead of the main loop instead of between events.
+int generatorCPU = -1; // CPU to pin that thread to. -1 leaves it unpinned.
+int bookReaderThreads = 0; // Threads that walk the book around the touch while the main loop trades, as analytics or agents would.
+u64 bookReaderSleepUS = 100; // How long each reader waits between walks.
+u64 openingAuctionLengthNS = 0; // How long orders accumulate before the first uncross. 0 starts in continuous trading.
+u64 closingAuctionStartNS = 0; // How long after the start the closing auction begins. 0 trades continuously forever.
+u64 closingAuctionLengthNS = 10000000000;
+
+// Simulated network latency between the participants or the user and the exchange. With everything at 0, messages arrive instantly.
+u64 latencyUserNS = 0; // Fixed delay of the user's messages.
+u64 latencyParticipantNS = 0; // Fixed delay of the participants' messages.
+u64 latencyJitterNS = 0; // Average random delay added to every message.
+bool uniformLatencyJitter = 0; // Draw the jitter uniformly from 0 to twice the average instead of exponentially.
+u64 gatewayServiceNS = 0; // Time the exchange gateway spends on each message. Messages queue behind each other while it is busy.
+u64 wheelTickNS = 1000; // Resolution of the timing wheel. Messages arriving within the same tick are delivered in the order they were sent.
+
+// Pre-trade risk limits for the user's orders. A limit of 0 disables that check.
+u32 riskMaxOrderSize = 0; // Maximum number of shares in one order.
+int riskMaxPosition = 0; // Maximum shares open in either direction, counting resting limit orders as filled.
+u64 riskMaxNotional = 0; // Maximum value of one order in cents.
+u32 riskPriceBand = 0; // Maximum number of cents an order's price may be from the midpoint.
+u32 riskMaxMessagesPerSecond = 0; // Maximum number of orders accepted per second of simulated time.
 
 
 u64 getTime() {
@@ -111,22 +504,27 @@ u64 getTime() {
 }
 
 u64 randState = 0;
-u64 randPrev = 0;
+u64 latencyRandState = 0; // Separate stream for latency jitter so that adding latency does not change the participants' orders.
 
 void setSeed(u64 seed) {
-	randPrev = 0;
 	randState = seed;
+	latencyRandState = seed ^ (u64)0x9e3779b97f4a7c15;
+}
+
+// Advance a generator's state and return its next random number.
+u64 nextRandom(u64* state) {
+	u64 prev = *state * (u64)0x388a2b457eb2cf89;
+	*state = prev + (prev >> 1) + (u64)0x2247aa1637b8f9d1;
+	return *state * (u64)0xc6ae4de299a7813d;
 }
 
-u64 random() {
-	randPrev = randState * (u64)0x388a2b457eb2cf89;
-	randState = randPrev + (randPrev >> 1) + (u64)0x2247aa1637b8f9d1;
-	return randState * (u64)0xc6ae4de299a7813d;
+u64 rand64() {
+	return nextRandom(&randState);
 }
 
 // Random uniform double from 0 to 1, inclusive.
 double rd() {
-	return (double)random() / (double)ULLONG_MAX;
+	return (double)rand64() / (double)ULLONG_MAX;
 }
 
 // Random positive integer with logarithmic distribution.
@@ -141,6 +539,123 @@ u64 rl(double average) {
 	return (u64)y + 1;
 }
 
+// Walker's alias table for drawing from a histogram in constant time, built with Vose's method.
+// Each bucket holds one value and the chance of keeping it. Otherwise, the bucket's alias is drawn instead.
+typedef struct {
+	u32 n;
+	u64* values;
+	u64* threshold; // Keep the bucket's own value if the low 32 bits of the random number are below this.
+	u32* alias;
+} aliasTable;
+aliasTable quantityTables[NUM_QUANTITIES];
+
+// Build an alias table drawing values[i] with probability weights[i] / sum of weights.
+void buildAliasTable(aliasTable* a, const u64* values, const double* weights, u32 n) {
+	double total = 0;
+	for (u32 i = 0; i < n; i++) {
+		total += weights[i];
+	}
+	a->n = n;
+	a->values = (u64*)malloc(n * sizeof(u64));
+	a->threshold = (u64*)malloc(n * sizeof(u64));
+	a->alias = (u32*)malloc(n * sizeof(u32));
+	memcpy(a->values, values, n * sizeof(u64));
+
+	// Sort the buckets into those below and above the average weight, then fill each small bucket up from a large one.
+	double* scaled = (double*)malloc(n * sizeof(double));
+	u32* small = (u32*)malloc(n * sizeof(u32));
+	u32* large = (u32*)malloc(n * sizeof(u32));
+	u32 numSmall = 0, numLarge = 0;
+	for (u32 i = 0; i < n; i++) {
+		scaled[i] = weights[i] * n / total;
+		if (scaled[i] < 1) small[numSmall++] = i;
+		else large[numLarge++] = i;
+	}
+	while (numSmall > 0 && numLarge > 0) {
+		u32 s = small[--numSmall];
+		u32 l = large[--numLarge];
+		a->threshold[s] = (u64)(scaled[s] * 4294967296.0);
+		a->alias[s] = l;
+		scaled[l] -= 1 - scaled[s];
+		if (scaled[l] < 1) small[numSmall++] = l;
+		else large[numLarge++] = l;
+	}
+
+	// What is left is full up to rounding error.
+	while (numLarge > 0) {
+		u32 l = large[--numLarge];
+		a->threshold[l] = (u64)1 << 32;
+		a->alias[l] = l;
+	}
+	while (numSmall > 0) {
+		u32 s = small[--numSmall];
+		a->threshold[s] = (u64)1 << 32;
+		a->alias[s] = s;
+	}
+	free(scaled);
+	free(small);
+	free(large);
+}
+
+// Draw a value from an alias table with one random number. The high half picks the bucket and the low half decides between its
+// value and its alias.
+u64 drawAlias(aliasTable* a) {
+	u64 r = rand64();
+	u32 i = (u32)(((r >> 32) * a->n) >> 32);
+	return (r & 0xffffffff) < a->threshold[i] ? a->values[i] : a->values[a->alias[i]];
+}
+
+// Load a histogram file into an alias table.
+void loadHistogram(aliasTable* a, const char* path) {
+	FILE* f = fopen(path, "r");
+	if (f == NULL) {
+		printf("ERROR: Could not open histogram %s.\n", path);
+		exit(1);
+	}
+	u32 n = 0, capacity = 64;
+	u64* values = (u64*)malloc(capacity * sizeof(u64));
+	double* weights = (double*)malloc(capacity * sizeof(double));
+	char line[256];
+	for (int lineNumber = 1; fgets(line, sizeof(line), f) != NULL; lineNumber++) {
+		if (line[0] == '#' || strspn(line, " \t\r\n") == strlen(line)) continue;
+		u64 value;
+		double weight;
+		if (sscanf(line, "%llu %lf", &value, &weight) != 2 || value == 0 || weight < 0) {
+			printf("ERROR: Line %d of histogram %s should hold a value of at least 1 and a weight that isn't negative.\n", lineNumber, path);
+			exit(1);
+		}
+		if (n == capacity) {
+			capacity *= 2;
+			values = (u64*)realloc(values, capacity * sizeof(u64));
+			weights = (double*)realloc(weights, capacity * sizeof(double));
+		}
+		values[n] = value;
+		weights[n] = weight;
+		n++;
+	}
+	fclose(f);
+
+	double total = 0;
+	for (u32 i = 0; i < n; i++) {
+		total += weights[i];
+	}
+	if (total <= 0) {
+		printf("ERROR: Histogram %s has no weight.\n", path);
+		exit(1);
+	}
+	buildAliasTable(a, values, weights, n);
+	free(values);
+	free(weights);
+}
+
+// Draw one of the participants' quantities, from its histogram if one was loaded and from rl(average) otherwise.
+u64 drawQuantity(int quantity, double average) {
+	if (quantityTables[quantity].n > 0) {
+		return drawAlias(&quantityTables[quantity]);
+	}
+	return rl(average);
+}
+
 
 // Convert an integer from 0 to 9999 into a string of width 4.
 void intToStringFixed(u32 p, char* s) {
@@ -229,28 +744,131 @@ char* priceToString(int p, char* s) {
 	return s1 + 3;
 }
 
+// Put a limit order that has left the book back on the free list, or in limbo while other threads may be reading the book.
+void retireLimitOrder(limitOrder* lo) {
+	if (epochReclamation) {
+		int b = globalEpoch % 3;
+		limboOrders[b][numLimboOrders[b]++] = lo;
+	}
+	else {
+		freeLimitOrders[numFreeLimitOrders++] = lo;
+	}
+}
+
+// Put a whole queue of limit orders that has left the book on the free chain, or in limbo while other threads may be reading the book.
+void retireQueue(limitOrder* head, limitOrder* tail) {
+	if (!epochReclamation) {
+		tail->next = freeChain;
+		freeChain = head;
+		return;
+	}
+	int b = globalEpoch % 3;
+	if (numLimboSegments[b] < LIMBO_SEGMENTS) {
+		limboSegmentHeads[b][numLimboSegments[b]] = head;
+		limboSegmentTails[b][numLimboSegments[b]] = tail;
+		numLimboSegments[b]++;
+	}
+	else {
+		for (limitOrder* curr = head; curr != NULL; curr = curr->next) {
+			limboOrders[b][numLimboOrders[b]++] = curr;
+		}
+	}
+}
+
+// Return every order in one limbo bag to the free list and free chain.
+void emptyLimbo(int b) {
+	memcpy(freeLimitOrders + numFreeLimitOrders, limboOrders[b], numLimboOrders[b] * sizeof(limitOrder*));
+	numFreeLimitOrders += numLimboOrders[b];
+	numLimboOrders[b] = 0;
+	for (int i = 0; i < numLimboSegments[b]; i++) {
+		limboSegmentTails[b][i]->next = freeChain;
+		freeChain = limboSegmentHeads[b][i];
+	}
+	numLimboSegments[b] = 0;
+}
+
+// Move to the next epoch if every reader has caught up with this one, and reuse the orders retired two epochs before it.
+void advanceEpoch() {
+	for (int i = 0; i < numBookReaders; i++) {
+		u64 e = loadAcquire(bookReaders[i].epoch);
+		if (e != 0 && e != globalEpoch) return;
+	}
+	storeRelease(globalEpoch, globalEpoch + 1);
+	// A reader that starts after this fence sees every order retired so far already unlinked. One that started before it
+	// has announced its epoch by the time of the next scan.
+	memoryFence();
+	emptyLimbo(globalEpoch % 3);
+}
+
+// Start and finish a read of the book from another thread. Nothing the reader reaches between them is reused until it finishes.
+void readerEnter(int id) {
+	storeRelease(bookReaders[id].epoch, loadAcquire(globalEpoch));
+	memoryFence();
+}
+
+void readerExit(int id) {
+	storeRelease(bookReaders[id].epoch, 0);
+}
+
+// Put a limit order that has left the book back on the free list.
+void freeLimitOrder(limitOrder* lo) {
+	retireLimitOrder(lo);
+	if (lo == compactPrev) {
+		compactPrev = NULL;
+		compactLost = 1;
+	}
+}
+
 // Update all limit orders at the given price, removing orders that have been deleted.
 void updateLimitOrders(u32 p, u64 t) {
-	limitOrder* curr = limitOrderHead[p];
-	if (curr != NULL) {
-		while (curr->expirationTime <= t) {
-			freeLimitOrders[numFreeLimitOrders++] = curr;
-			limitOrderHead[p] = curr->next;
-			curr = curr->next;
-			if (curr == NULL) return;
-		}
+	// Skip the walk if nothing at this price can have expired yet.
+	if (levelMinExpiration[p] > t) return;
 
-		while (curr->next != NULL) {
-			limitOrder* next = curr->next;
-			if (next->expirationTime <= t) {
-				freeLimitOrders[numFreeLimitOrders++] = next;
-				curr->next = next->next;
-			}
-			else {
-				curr = next;
+	u64 minExpiration = ULLONG_MAX;
+	limitOrder* last = NULL;
+	limitOrder** link = &limitOrderHead[p];
+	while (*link != NULL) {
+		limitOrder* curr = *link;
+		if (curr->expirationTime <= t) {
+			freeLimitOrder(curr);
+			levelVolume[p] -= curr->size;
+			levelUserOrders[p] -= curr->user;
+			levelOrders[p]--;
+			u32 prevId = last != NULL ? last->id : 0;
+			hashOrder(p, curr->id, curr->size, prevId);
+			if (curr->next != NULL) {
+				hashOrder(p, curr->next->id, curr->next->size, curr->id);
+				hashOrder(p, curr->next->id, curr->next->size, prevId);
 			}
+			publish(*link, curr->next);
+		}
+		else {
+			if (curr->expirationTime < minExpiration) minExpiration = curr->expirationTime;
+			last = curr;
+			link = &curr->next;
 		}
 	}
+	levelTail[p] = last;
+	levelMinExpiration[p] = minExpiration;
+}
+
+// Recompute the running totals of a price level after its list was changed directly.
+void recountLevel(u32 p) {
+	levelTail[p] = NULL;
+	levelVolume[p] = 0;
+	levelUserOrders[p] = 0;
+	levelMinExpiration[p] = ULLONG_MAX;
+	levelOrders[p] = 0;
+	bookHash ^= levelHash[p];
+	levelHash[p] = 0;
+	for (limitOrder* curr = limitOrderHead[p]; curr != NULL; curr = curr->next) {
+		hashOrder(p, curr->id, curr->size, levelTail[p] != NULL ? levelTail[p]->id : 0);
+		levelTail[p] = curr;
+		levelOrders[p]++;
+		levelVolume[p] += curr->size;
+		levelUserOrders[p] += curr->user;
+		if (curr->expirationTime < levelMinExpiration[p]) levelMinExpiration[p] = curr->expirationTime;
+	}
 }
 
 void clearConsole() {
@@ -282,8 +900,14 @@ void updateBidAndAsk() {
 	}
 }
 
-// Print the current limit order tape.
-void printOrderBook() {
+// Speeds of the simulated clock relative to the wall clock, chosen with [ and ].
+#define NUM_TIME_SCALES 13
+double timeScales[NUM_TIME_SCALES] = { 0.1, 0.2, 0.5, 1, 2, 5, 10, 20, 50, 100, 200, 500, 1000 };
+int timeScaleIndex = 3;
+bool clockBehind = 0; // Whether the engine couldn't keep up with the clock during the last frame.
+
+// Print the shares at the prices around the midpoint, given the shares resting at each price.
+void printLevels(const u32* volumes, u32 bid, u32 ask) {
 
 	int numLinesAbovePrice = numOrderBookLines / 2;
 	int numLinesBelowPrice = numOrderBookLines - 1 - numLinesAbovePrice;
@@ -297,16 +921,7 @@ void printOrderBook() {
 	for (u32 p = maxPrice; p >= minPrice; p--) {
 		int i = maxPrice - p;
 
-		u32 x = 0;
-		u32 c = 0;
-
-		// Sum up the total number of shares at this price.
-		limitOrder* curr = limitOrderHead[p];
-		while (curr != NULL) {
-			x += curr->size;
-			c++;
-			curr = curr->next;
-		}
+		u32 x = volumes[p];
 
 		// Initialize this line.
 		for (int j = 0; j < lineWidth; j++) {
@@ -329,6 +944,11 @@ void printOrderBook() {
 	}
 	s[numOrderBookLines * lineWidth] = '\0';
 	printf("%s\n", s);
+}
+
+// Print the current limit order tape.
+void printOrderBook() {
+	printLevels(levelVolume, bid, ask);
 
 	char s0[100];
 	char* s1 = priceToString(balance, s0);
@@ -337,7 +957,25 @@ void printOrderBook() {
 
 	s1 = intToString(sharesOpen, s0);
 	*s1 = 0;
-	printf("Shares open: %s\n\n", s0);
+	printf("Shares open: %s\n", s0);
+	if (numRiskRejects > 0) {
+		printf("Risk rejects: %i (last: %s)\n", numRiskRejects, riskRejectText[lastRiskReject]);
+	}
+	if (numMessagesInFlight > 0) {
+		printf("Messages in flight: %i\n", numMessagesInFlight);
+	}
+	if (marketPhase == PHASE_OPENING_AUCTION || marketPhase == PHASE_CLOSING_AUCTION) {
+		s1 = priceToString(indicativePrice, s0);
+		*s1 = 0;
+		printf("%s: indicative %s x%u\n", phaseText[marketPhase], s0, indicativeVolume);
+	}
+	else if (marketPhase == PHASE_CLOSED) {
+		s1 = priceToString(lastUncrossPrice, s0);
+		*s1 = 0;
+		printf("%s: closing price %s x%u\n", phaseText[marketPhase], s0, lastUncrossVolume);
+	}
+	printf("Speed: %gx%s\n", timeScales[timeScaleIndex], clockBehind ? " (falling behind)" : "");
+	printf("\n");
 
 	printf("%i limit orders\n", numUserLimitOrders);
 	int cb = 0, cs = 0;
@@ -410,95 +1048,608 @@ void printOrderBook() {
 	printf("\n\n");
 }
 
-// Make and add a new limit order to this price's linked list.
-void addLimitOrder(u32 p, u32 size, u64 expirationTime, bool user) {
+// Rewind buffer: a record of what the book looked like at every frame, kept in a fixed amount of memory so that the user can pause
+// and look back. Every rewindKeyframeInterval frames, a keyframe stores every price with shares resting at it. The frames between
+// store only the prices whose shares changed since the frame before, read from levelVolume, along with the touch, the user's account
+// and their resting orders. Records go one after another in a byte ring, and when it fills up the oldest are overwritten.
+// Rewinding to a frame replays the deltas since the last keyframe before it.
+#define REWIND_MAX_FRAMES 65536
+typedef struct {
+	u64 t;
+	u32 bid, ask;
+	int balance, sharesOpen;
+	u32 numLevels; // Prices that follow the header, as (price, shares) pairs.
+	u32 numUserOrders; // The user's orders that follow them, as (price, size) pairs.
+	bool keyframe;
+} rewindHeader;
+typedef struct {
+	u64 position; // Where in the byte stream the frame's record starts. Wraps around the ring.
+	bool keyframe;
+} rewindFrame;
+unsigned char* rewindBytes = NULL;
+u64 rewindWritten = 0; // Bytes written to the ring since the start.
+rewindFrame rewindFrames[REWIND_MAX_FRAMES];
+u64 rewindFirstFrame = 0; // Oldest frame that can still be shown. It is always a keyframe.
+u64 rewindNumFrames = 0; // Frames recorded since the start.
+u32 rewindLastVolume[NUM_PRICES]; // The shares at each price as of the last frame recorded.
+u32* rewindPairs = NULL; // Scratch space for one record's pairs.
+bool rewinding = 0;
+u64 rewindViewFrame = 0;
+rewindHeader rewindView; // The frame being shown and the shares at each price at that frame.
+u32 rewindViewVolume[NUM_PRICES];
+u32 rewindViewOrders[2 * MAX_NUM_USER_LIMIT_ORDERS];
 
-	// Randomly make a limit order.
-	if (numFreeLimitOrders == 0) {
-		printf("Ran out of free limit orders available for use.\n");
+void rewindCopyIn(const void* data, u64 size) {
+	const unsigned char* d = (const unsigned char*)data;
+	u64 at = rewindWritten % rewindBufferBytes;
+	u64 first = size < rewindBufferBytes - at ? size : rewindBufferBytes - at;
+	memcpy(rewindBytes + at, d, first);
+	memcpy(rewindBytes, d + first, size - first);
+	rewindWritten += size;
+}
+
+void rewindCopyOut(void* data, u64 position, u64 size) {
+	unsigned char* d = (unsigned char*)data;
+	u64 at = position % rewindBufferBytes;
+	u64 first = size < rewindBufferBytes - at ? size : rewindBufferBytes - at;
+	memcpy(d, rewindBytes + at, first);
+	memcpy(d + first, rewindBytes, size - first);
+}
+
+// Record the frame at time t.
+void recordRewindFrame(u64 t) {
+	if (rewindBytes == NULL) {
+		rewindBytes = (unsigned char*)malloc(rewindBufferBytes);
+		rewindPairs = (u32*)malloc(2 * (NUM_PRICES + MAX_NUM_USER_LIMIT_ORDERS) * sizeof(u32));
+		memset(rewindLastVolume, 0, sizeof(rewindLastVolume));
+	}
+
+	rewindHeader h;
+	memset(&h, 0, sizeof(h));
+	h.t = t;
+	h.bid = bid;
+	h.ask = ask;
+	h.balance = balance;
+	h.sharesOpen = sharesOpen;
+	h.keyframe = rewindNumFrames % rewindKeyframeInterval == 0;
+	u32 n = 0;
+	for (u32 p = 0; p < NUM_PRICES; p++) {
+		u32 v = levelVolume[p];
+		if (h.keyframe ? v != 0 : v != rewindLastVolume[p]) {
+			rewindPairs[n++] = p;
+			rewindPairs[n++] = v;
+		}
+		rewindLastVolume[p] = v;
+	}
+	h.numLevels = n / 2;
+	for (int i = 0; i < numUserLimitOrders; i++) {
+		rewindPairs[n++] = userLimitOrders[i]->p;
+		rewindPairs[n++] = userLimitOrders[i]->size;
+	}
+	h.numUserOrders = numUserLimitOrders;
+
+	u64 size = sizeof(h) + n * sizeof(u32);
+	if (size > rewindBufferBytes / 4) {
+		printf("ERROR: rewindBufferBytes is too small to hold a frame of the book.\n");
 		exit(1);
 	}
-	limitOrder* lo = freeLimitOrders[--numFreeLimitOrders];
+
+	// Forget the frames this record is about to overwrite, and the deltas that no longer have a keyframe before them.
+	if (rewindNumFrames - rewindFirstFrame == REWIND_MAX_FRAMES) {
+		rewindFirstFrame++;
+	}
+	while (rewindFirstFrame < rewindNumFrames && rewindFrames[rewindFirstFrame % REWIND_MAX_FRAMES].position + rewindBufferBytes < rewindWritten + size) {
+		rewindFirstFrame++;
+	}
+	while (rewindFirstFrame < rewindNumFrames && !rewindFrames[rewindFirstFrame % REWIND_MAX_FRAMES].keyframe) {
+		rewindFirstFrame++;
+	}
+
+	rewindFrame* f = &rewindFrames[rewindNumFrames % REWIND_MAX_FRAMES];
+	f->position = rewindWritten;
+	f->keyframe = h.keyframe;
+	rewindCopyIn(&h, sizeof(h));
+	rewindCopyIn(rewindPairs, n * sizeof(u32));
+	rewindNumFrames++;
+}
+
+// Rebuild the book as it was at frame i into the rewind view.
+void showRewindFrame(u64 i) {
+	u64 k = i;
+	while (!rewindFrames[k % REWIND_MAX_FRAMES].keyframe) {
+		k--;
+	}
+	memset(rewindViewVolume, 0, sizeof(rewindViewVolume));
+	for (; k <= i; k++) {
+		u64 position = rewindFrames[k % REWIND_MAX_FRAMES].position;
+		rewindCopyOut(&rewindView, position, sizeof(rewindHeader));
+		position += sizeof(rewindHeader);
+		rewindCopyOut(rewindPairs, position, rewindView.numLevels * 2 * sizeof(u32));
+		for (u32 j = 0; j < rewindView.numLevels; j++) {
+			rewindViewVolume[rewindPairs[2 * j]] = rewindPairs[2 * j + 1];
+		}
+		position += rewindView.numLevels * 2 * sizeof(u32);
+		rewindCopyOut(rewindViewOrders, position, rewindView.numUserOrders * 2 * sizeof(u32));
+	}
+	rewindViewFrame = i;
+}
+
+// Move the rewind view by the given number of frames, entering it at the latest frame if needed.
+// Moving past the latest frame leaves the view and carries on trading.
+void stepRewind(long long frames) {
+	if (rewindFirstFrame == rewindNumFrames || !rewindFrames[rewindFirstFrame % REWIND_MAX_FRAMES].keyframe) return;
+	long long i = (long long)(rewinding ? rewindViewFrame : rewindNumFrames - 1) + frames;
+	if (i >= (long long)rewindNumFrames) {
+		rewinding = 0;
+		return;
+	}
+	if (i < (long long)rewindFirstFrame) i = rewindFirstFrame;
+	rewinding = 1;
+	showRewindFrame(i);
+}
+
+void printRewind() {
+	printLevels(rewindViewVolume, rewindView.bid, rewindView.ask);
+
+	char s0[100];
+	char* s1 = priceToString(rewindView.balance, s0);
+	*s1 = 0;
+	printf("Balance: %s\n", s0);
+	s1 = intToString(rewindView.sharesOpen, s0);
+	*s1 = 0;
+	printf("Shares open: %s\n", s0);
+	printf("%u limit orders: ", rewindView.numUserOrders);
+	for (u32 i = 0; i < rewindView.numUserOrders; i++) {
+		s1 = priceToString(rewindViewOrders[2 * i], s0);
+		*s1 = 0;
+		printf("%s x%u  ", s0, rewindViewOrders[2 * i + 1]);
+	}
+	printf("\n\n");
+
+	u64 latest = rewindFrames[(rewindNumFrames - 1) % REWIND_MAX_FRAMES].position;
+	rewindHeader h;
+	rewindCopyOut(&h, latest, sizeof(h));
+	printf("REWOUND %.1f s (%llu of %llu frames kept)\n", (double)(h.t - rewindView.t) / 1e9, rewindViewFrame - rewindFirstFrame + 1,
+		rewindNumFrames - rewindFirstFrame);
+	printf("Step: - and =, 10 seconds: _ and +, resume: SPACE\n");
+}
+
+// Check an order of the user's at price p against every pre-trade risk limit. Return RISK_OK if the order may be sent.
+// Every check compares against a counter that is kept up to date as orders are added and filled, so this is constant time.
+int riskCheck(bool isBuy, u32 size, u32 p, u64 t) {
+
+	// Start a new message-rate window once a second has passed.
+	if (t - riskWindowStart >= 1000000000) {
+		riskWindowStart = t;
+		riskWindowMessages = 0;
+	}
+	if (riskMaxMessagesPerSecond && riskWindowMessages >= riskMaxMessagesPerSecond) return RISK_MESSAGE_RATE;
+
+	if (riskMaxOrderSize && size > riskMaxOrderSize) return RISK_ORDER_SIZE;
+	if (riskMaxNotional && (u64)size * p > riskMaxNotional) return RISK_NOTIONAL;
+
+	if (riskPriceBand) {
+		u32 mid = (bid + ask) / 2;
+		u32 distance = p > mid ? p - mid : mid - p;
+		if (distance > riskPriceBand) return RISK_PRICE_BAND;
+	}
+
+	// Assume that every resting, queued or in-flight order on the same side fills along with this one.
+	if (riskMaxPosition) {
+		if (isBuy) {
+			int buys = userOpenBuyShares + userAuctionBuyShares + userInFlightBuyShares + pendingStrategyBuyShares;
+			if (sharesOpen + buys + (int)size > riskMaxPosition) return RISK_POSITION;
+		}
+		else {
+			int sells = userOpenSellShares + userAuctionSellShares + userInFlightSellShares + pendingStrategySellShares;
+			if (sharesOpen - sells - (int)size < -riskMaxPosition) return RISK_POSITION;
+		}
+	}
+
+	riskWindowMessages++;
+	return RISK_OK;
+}
+
+// Run the pre-trade risk checks on an order of the user's, recording the reason if it is rejected.
+bool riskAccept(bool isBuy, u32 size, u32 p, u64 t) {
+	int r = riskCheck(isBuy, size, p, t);
+	if (r != RISK_OK) {
+		numRiskRejects++;
+		lastRiskReject = r;
+		return 0;
+	}
+	return 1;
+}
+
+// Run the pre-trade risk checks on one of the user's messages before it is sent at time t. Cancels always pass.
+bool riskAcceptMessage(orderMessage* m, u64 t) {
+	if (m->type == MESSAGE_CANCEL_ALL) return 1;
+	bool isBuy = m->type == MESSAGE_MARKET_BUY || m->type == MESSAGE_LIMIT_BUY;
+	u32 p = m->price != PRICE_AT_TOUCH ? m->price : isBuy ? ask : bid;
+	return riskAccept(isBuy, m->size, p, t);
+}
+
+void commitMemory(void* p, u64 size, int mode);
+
+// Commit the next block of the pool and of the free list.
+void commitPool() {
+	int n = poolSize - poolCommitted < POOL_COMMIT_ORDERS ? poolSize - poolCommitted : POOL_COMMIT_ORDERS;
+	commitMemory(limitOrderPool + poolCommitted, (u64)n * sizeof(limitOrder), poolPagesMode);
+	commitMemory(freeLimitOrders + poolCommitted, (u64)n * sizeof(limitOrder*), 0);
+	commitMemory(poolBitmap + poolCommitted / 64, ((u64)n + 63) / 64 * sizeof(u64), 0);
+	for (int b = 0; b < 3; b++) {
+		commitMemory(limboOrders[b] + poolCommitted, (u64)n * sizeof(limitOrder*), 0);
+	}
+	poolCommitted += n;
+}
+
+// Index of the lowest set bit of a nonzero word.
+int countTrailingZeros(u64 x) {
+#if defined(_WIN32)
+	unsigned long i;
+	_BitScanForward64(&i, x);
+	return (int)i;
+#else
+	return __builtin_ctzll(x);
+#endif
+}
+
+// Take a limit order from the free list, then from the free chain, then from the compactor's bitmap, then from the unused part of the pool,
+// and set its fields.
+limitOrder* newLimitOrder(u32 p, u32 size, u64 expirationTime, bool user) {
+	limitOrder* lo;
+	if (numFreeLimitOrders > 0) {
+		lo = freeLimitOrders[--numFreeLimitOrders];
+	}
+	else if (freeChain != NULL) {
+		lo = freeChain;
+		freeChain = lo->next;
+	}
+	else if (numBitmapFree > 0) {
+		u32 w = bitmapCursor / 64;
+		while (poolBitmap[w] == ~(u64)0) {
+			w++;
+		}
+		u32 i = w * 64 + countTrailingZeros(~poolBitmap[w]);
+		poolBitmap[w] |= (u64)1 << (i % 64);
+		numBitmapFree--;
+		bitmapCursor = i + 1;
+		lo = limitOrderPool + i;
+	}
+	else {
+		if (poolHighWater == poolSize) {
+			printf("Ran out of free limit orders available for use.\n");
+			exit(1);
+		}
+		if (poolHighWater == poolCommitted) {
+			commitPool();
+		}
+		poolBitmap[poolHighWater / 64] |= (u64)1 << (poolHighWater % 64);
+		lo = limitOrderPool + poolHighWater++;
+	}
 	lo->next = NULL;
 	lo->size = size;
 	lo->expirationTime = expirationTime;
 	lo->p = p;
 	lo->user = user;
+	lo->id = ++nextOrderId;
 
 	// If the limit order belongs to the user, add it to the list of the user's limit orders.
 	if (user) {
 		userLimitOrders[numUserLimitOrders++] = lo;
 	}
+	return lo;
+}
+
+// Make and add a new limit order to this price's linked list.
+void addLimitOrder(u32 p, u32 size, u64 expirationTime, bool user) {
+
+	// Randomly make a limit order.
+	limitOrder* lo = newLimitOrder(p, size, expirationTime, user);
+	levelVolume[p] += size;
+	levelUserOrders[p] += user;
+	levelOrders[p]++;
+	if (expirationTime < levelMinExpiration[p]) levelMinExpiration[p] = expirationTime;
 
 	limitOrder* curr = limitOrderHead[p];
 	if (curr == NULL) {
-		limitOrderHead[p] = lo;
+		hashOrder(p, lo->id, size, 0);
+		publish(limitOrderHead[p], lo);
+		levelTail[p] = lo;
 	}
 	else {
 		if (fillTiesInStackOrder) {
 			// Add from the front and fill from the front.
+			hashOrder(p, lo->id, size, 0);
+			hashOrder(p, curr->id, curr->size, 0);
+			hashOrder(p, curr->id, curr->size, lo->id);
 			lo->next = curr;
-			limitOrderHead[p] = lo;
+			publish(limitOrderHead[p], lo);
 		}
 		else {
 			// Add from the back and fill from the front.
-			while (curr->next != NULL) {
-				curr = curr->next;
-			}
-			curr->next = lo;
+			hashOrder(p, lo->id, size, levelTail[p]->id);
+			publish(levelTail[p]->next, lo);
+			levelTail[p] = lo;
 		}
 	}
 }
 
-// Fill orders at one price until size becomes 0. Update the values size and o.
-void fillOrders(u32 p, u32* size, u32* o, bool isSell) {
-	// Fill orders at this price.
-	for (limitOrder* curr = limitOrderHead[p]; curr != NULL; curr = curr->next) {
+// Give a slot to the compactor's bitmap.
+void releaseSlot(u32 i) {
+	poolBitmap[i / 64] &= ~((u64)1 << (i % 64));
+	numBitmapFree++;
+	if (i < bitmapCursor) bitmapCursor = i;
+}
 
-		u32 s = curr->size;
-		if (*size >= s) {
-			// Completely fill the limit order and remove it.
-			*o += s * p;
-			*size -= s;
-			freeLimitOrders[numFreeLimitOrders++] = curr;
-			if (curr->user) {
-				// Completely fill the user's limit order.
-				if (isSell) {
-					balance -= s * p;
-					sharesOpen += s;
-				}
-				else {
-					balance += s * p;
-					sharesOpen -= s;
-				}
+// Claim n free slots in a row for the compactor, searching forward from compactSearch and looking at no more than *budget words of the bitmap.
+// If there is no run big enough below the high-water mark, take the slots from above it.
+// Return 1 with *start set if the slots were claimed, 0 if the search goes on in the next slice, or -1 if there is no room anywhere.
+int claimRun(u32 n, u32* start, int* budget) {
+	u32 end = (u32)poolHighWater;
+	u32 runStart = compactSearch;
+	u32 runLength = 0;
+	u32 i = compactSearch;
 
-				// Delete the user's limit order.
-				for (int i = 0; i < numUserLimitOrders; i++) {
-					if (userLimitOrders[i] == curr) {
-						numUserLimitOrders--;
-						for (int j = i; j < numUserLimitOrders; j++) {
-							userLimitOrders[j] = userLimitOrders[j + 1];
-						}
-						break;
-					}
-				}
-			}
-			limitOrderHead[p] = curr->next;
+	// A run longer than half of what a slice can scan might never be found, so those levels go straight above the high-water mark.
+	if (n > (u32)compactionSliceOrders * 32) {
+		i = end;
+	}
+
+	while (i < end && runLength < n) {
+		if (*budget <= 0) {
+			// Carry on next slice from the start of the run so far, since the bitmap may change in between.
+			compactSearch = runLength > 0 ? runStart : i;
+			return 0;
+		}
+		(*budget)--;
+
+		// Jump over the next stretch of used or free slots in this word.
+		u64 word = poolBitmap[i / 64] >> (i % 64);
+		u32 left = 64 - i % 64;
+		if (word & 1) {
+			u64 free = ~word;
+			if (left < 64) free &= ((u64)1 << left) - 1;
+			runLength = 0;
+			i += free == 0 ? left : (u32)countTrailingZeros(free);
 		}
 		else {
-			// Partially fill the limit order.
-			*o += *size * p;
-			curr->size -= *size;
-			if (curr->user) {
-				// Partially fill the user's limit order.
-				if (isSell) {
-					balance -= *size * p;
-					sharesOpen += *size;
+			u32 length = word == 0 ? left : (u32)countTrailingZeros(word);
+			if (runLength == 0) runStart = i;
+			runLength += length;
+			i += length;
+		}
+	}
+	if (runLength > 0 && runStart + runLength > end) {
+		// The last run may have counted slots past the high-water mark.
+		runLength = end - runStart;
+	}
+
+	if (runLength >= n) {
+		for (u32 k = runStart; k < runStart + n; k++) {
+			poolBitmap[k / 64] |= (u64)1 << (k % 64);
+		}
+		numBitmapFree -= n;
+		compactSearch = runStart + n;
+	}
+	else if ((u64)poolHighWater + n <= (u64)poolSize) {
+		// There is no run big enough below the high-water mark, so this and every later level goes above it.
+		runStart = poolHighWater;
+		for (u32 k = 0; k < n; k++) {
+			if (poolHighWater == poolCommitted) {
+				commitPool();
+			}
+			poolBitmap[poolHighWater / 64] |= (u64)1 << (poolHighWater % 64);
+			poolHighWater++;
+		}
+		compactSearch = poolHighWater;
+	}
+	else {
+		return -1;
+	}
+	*start = runStart;
+	return 1;
+}
+
+// Start a compaction pass.
+void startCompaction() {
+	compactActive = 1;
+	compactTakeoverLeft = numFreeLimitOrders;
+	compactPrice = 0;
+	compactLevelActive = 0;
+	compactPrev = NULL;
+	compactSearch = 0;
+}
+
+// Do at most compactionSliceOrders steps of the compactor's pass. Each step takes one order from the free list, moves one order,
+// or checks up to 64 empty price levels.
+void compactSlice() {
+	int budget = compactionSliceOrders;
+
+	// Take over the free orders that were there when the pass started.
+	while (budget > 0 && (compactTakeoverLeft > 0 || freeChain != NULL)) {
+		limitOrder* lo;
+		if (compactTakeoverLeft > 0 && numFreeLimitOrders > 0) {
+			lo = freeLimitOrders[--numFreeLimitOrders];
+			compactTakeoverLeft--;
+		}
+		else if (freeChain != NULL) {
+			lo = freeChain;
+			freeChain = lo->next;
+		}
+		else {
+			compactTakeoverLeft = 0;
+			break;
+		}
+		releaseSlot((u32)(lo - limitOrderPool));
+		budget--;
+	}
+
+	while (budget > 0) {
+		if (!compactLevelActive) {
+			// Find the next level with orders and claim a run of slots for it.
+			for (int k = 0; k < 64 && compactPrice < NUM_PRICES && limitOrderHead[compactPrice] == NULL; k++) {
+				compactPrice++;
+			}
+			budget--;
+			if (compactPrice >= NUM_PRICES) {
+				compactActive = 0;
+				return;
+			}
+			if (limitOrderHead[compactPrice] == NULL) continue;
+
+			int claimed = claimRun(levelOrders[compactPrice], &compactRunNext, &budget);
+			if (claimed == 0) return;
+			if (claimed < 0) {
+				compactPrice++;
+				continue;
+			}
+			compactRunEnd = compactRunNext + levelOrders[compactPrice];
+			compactLevelActive = 1;
+			compactPrev = NULL;
+			compactLost = 0;
+		}
+
+		u32 p = compactPrice;
+		limitOrder** link = compactPrev != NULL ? &compactPrev->next : &limitOrderHead[p];
+		if (compactLost || *link == NULL || compactRunNext == compactRunEnd) {
+			// The level is done. Give back any slots it no longer needed.
+			for (u32 i = compactRunNext; i < compactRunEnd; i++) {
+				releaseSlot(i);
+			}
+			compactLevelActive = 0;
+			compactPrev = NULL;
+			compactPrice++;
+			continue;
+		}
+
+		// Move the next order and fix up everything that points to it.
+		limitOrder* src = *link;
+		limitOrder* dst = limitOrderPool + compactRunNext++;
+		*dst = *src;
+		publish(*link, dst);
+		if (levelTail[p] == src) {
+			levelTail[p] = dst;
+		}
+		if (src->user) {
+			for (int i = 0; i < numUserLimitOrders; i++) {
+				if (userLimitOrders[i] == src) {
+					userLimitOrders[i] = dst;
+					break;
 				}
-				else {
-					balance += *size * p;
-					sharesOpen -= *size;
+			}
+		}
+		retireLimitOrder(src);
+		compactPrev = dst;
+		budget--;
+	}
+}
+
+// Run a slice of the compactor between events, starting a pass every compactionIntervalNS.
+void compactStep(u64 t) {
+	if (compactionIntervalNS == 0) return;
+	if (!compactActive) {
+		if (t < nextCompaction) return;
+		nextCompaction = t + compactionIntervalNS;
+		startCompaction();
+	}
+	compactSlice();
+}
+
+// Tell the strategy that s shares of the user's orders traded at price p.
+void strategyFill(u32 p, u32 s, bool isBuy) {
+	userSharesTraded += s;
+	if (strategy.onFill != NULL) {
+		strategy.onFill(strategy.state, p, s, isBuy);
+	}
+}
+
+// Account for s shares of one of the user's limit orders being filled at price p. Delete it from the user's list if it was completely filled.
+// The order must already be out of the book, so that the strategy sees the book as it is after the fill.
+void fillUserLimitOrder(limitOrder* lo, u32 s, u32 p, bool isSell, bool complete) {
+	if (isSell) {
+		balance -= s * p;
+		sharesOpen += s;
+		userOpenBuyShares -= s;
+	}
+	else {
+		balance += s * p;
+		sharesOpen -= s;
+		userOpenSellShares -= s;
+	}
+
+	if (complete) {
+		for (int i = 0; i < numUserLimitOrders; i++) {
+			if (userLimitOrders[i] == lo) {
+				numUserLimitOrders--;
+				for (int j = i; j < numUserLimitOrders; j++) {
+					userLimitOrders[j] = userLimitOrders[j + 1];
 				}
+				break;
+			}
+		}
+	}
+	strategyFill(p, s, isSell);
+}
+
+// Fill orders at one price until size becomes 0. Update the values size and o.
+// Expired orders must already have been removed from this price with updateLimitOrders.
+void fillOrders(u32 p, u32* size, u32* o, bool isSell) {
+	// If the whole level is consumed and none of it is the user's, hand all of its orders back at once.
+	if (limitOrderHead[p] != NULL && *size >= levelVolume[p] && levelUserOrders[p] == 0) {
+		*o += levelVolume[p] * p;
+		*size -= levelVolume[p];
+		limitOrder* head = limitOrderHead[p];
+		publish(limitOrderHead[p], NULL);
+		retireQueue(head, levelTail[p]);
+		bookHash ^= levelHash[p];
+		levelHash[p] = 0;
+		levelTail[p] = NULL;
+		levelVolume[p] = 0;
+		levelOrders[p] = 0;
+		levelMinExpiration[p] = ULLONG_MAX;
+		if (compactLevelActive && compactPrice == p) {
+			compactPrev = NULL;
+			compactLost = 1;
+		}
+		return;
+	}
+
+	// Fill orders at this price.
+	for (limitOrder* curr = limitOrderHead[p]; curr != NULL && *size > 0; curr = curr->next) {
+
+		u32 s = curr->size;
+		if (*size >= s) {
+			// Completely fill the limit order and remove it.
+			*o += s * p;
+			*size -= s;
+			levelVolume[p] -= s;
+			levelUserOrders[p] -= curr->user;
+			levelOrders[p]--;
+			hashOrder(p, curr->id, s, 0);
+			if (curr->next != NULL) {
+				hashOrder(p, curr->next->id, curr->next->size, curr->id);
+				hashOrder(p, curr->next->id, curr->next->size, 0);
+			}
+			freeLimitOrder(curr);
+			publish(limitOrderHead[p], curr->next);
+			if (curr->next == NULL) {
+				levelTail[p] = NULL;
+			}
+			// The order keeps its contents until the pool hands it out again, which can't happen before the event is finished.
+			if (curr->user) {
+				fillUserLimitOrder(curr, s, p, isSell, 1);
+			}
+		}
+		else {
+			// Partially fill the limit order.
+			*o += *size * p;
+			hashOrder(p, curr->id, curr->size, 0);
+			curr->size -= *size;
+			hashOrder(p, curr->id, curr->size, 0);
+			levelVolume[p] -= *size;
+			if (curr->user) {
+				fillUserLimitOrder(curr, *size, p, isSell, 0);
 			}
 			*size = 0;
 			break;
@@ -522,7 +1673,11 @@ u32 marketSell(u32 size, u64 t) {
 
 		updateLimitOrders(p, t);
 
+		u32 before = size;
 		fillOrders(p, &size, &o, 1);
+		if (userAggressor && before != size) {
+			strategyFill(p, before - size, 0);
+		}
 	}
 
 	return o;
@@ -544,249 +1699,4533 @@ u32 marketBuy(u32 size, u64 t) {
 
 		updateLimitOrders(p, t);
 
+		u32 before = size;
 		fillOrders(p, &size, &o, 0);
+		if (userAggressor && before != size) {
+			strategyFill(p, before - size, 1);
+		}
 	}
 
 	return o;
 }
 
-// Perform the main cycle of creating limit and market orders, deleting orders, and handling the user's orders.
-void mainCycle(u64 startingTime) {
+// Add an order entered during an auction to its side's queue without matching it.
+void addAuctionOrder(u32 p, u32 size, u64 expirationTime, bool user, bool isSell, bool isMarket) {
+	limitOrder* lo = newLimitOrder(p, size, expirationTime, user && !isMarket);
+	lo->user = user;
 
-	// Initialize the process.
-	u64 nextOrderCreation = startingTime;
-	u64 targetTime = startingTime;
+	limitOrder** head;
+	if (isMarket) {
+		head = isSell ? &auctionMarketSellHead : &auctionMarketBuyHead;
+	}
+	else {
+		head = isSell ? &auctionSellHead[p] : &auctionBuyHead[p];
+		if (p < auctionMinPrice) auctionMinPrice = p;
+		if (p > auctionMaxPrice) auctionMaxPrice = p;
+	}
+	lo->next = *head;
+	*head = lo;
+}
 
-	while (1) {
+// Remove expired orders from an auction queue and return the number of shares left in it.
+u32 auctionQueueVolume(limitOrder** head, u64 t) {
+	u32 x = 0;
+	while (*head != NULL) {
+		limitOrder* curr = *head;
+		if (curr->expirationTime <= t) {
+			freeLimitOrder(curr);
+			*head = curr->next;
+		}
+		else {
+			x += curr->size;
+			head = &curr->next;
+		}
+	}
+	return x;
+}
 
-		// Do the next order creation.
-		if (nextOrderCreation < targetTime) {
+// Update the continuous book at price p and return the number of shares resting there.
+u32 continuousLevelVolume(u32 p, u64 t) {
+	updateLimitOrders(p, t);
+	return levelVolume[p];
+}
 
-			// Choose a limit or market order.
-			if (rd() < marketOrderProbability) {
-				// Randomly choose a market order size.
-				u32 size = rl(averageMarketOrderSize);
+// Find the price that uncrosses the auction at time t: the one executing the most shares, then leaving the smallest imbalance,
+// then closest to the midpoint. Set the range of prices that were considered and return the number of shares that execute.
+u32 findUncrossPrice(u64 t, u32* price, u32* low, u32* high) {
+	u32 marketBuys = auctionQueueVolume(&auctionMarketBuyHead, t);
+	u32 marketSells = auctionQueueVolume(&auctionMarketSellHead, t);
 
-				// Choose whether it is a buy or sell.
-				if (random() % 2) {
-					marketSell(size, nextOrderCreation);
-				}
-				else {
-					marketBuy(size, nextOrderCreation);
-				}
-			}
-			else {
+	// Collect the shares at each price from the auction queues and from the continuous book.
+	u32 lo = auctionMinPrice < bid ? auctionMinPrice : bid;
+	u32 hi = auctionMaxPrice > ask ? auctionMaxPrice : ask;
+	u32 totalBuys = marketBuys;
+	u32 totalSells = marketSells;
+	for (u32 p = lo; p <= hi; p++) {
+		u32 x = continuousLevelVolume(p, t);
+		auctionBuyLevel[p] = auctionQueueVolume(&auctionBuyHead[p], t) + (p <= bid ? x : 0);
+		auctionSellLevel[p] = auctionQueueVolume(&auctionSellHead[p], t) + (p >= ask ? x : 0);
+		totalBuys += auctionBuyLevel[p];
+		totalSells += auctionSellLevel[p];
+	}
 
-				// Choose whether it is a buy or sell.
-				if (random() % 2) {
-					// Create a sell limit order above the bid.
-					u32 p = bid + rl(averageLimitOrderDistance);
-					addLimitOrder(p, rl(averageLimitOrderSize), nextOrderCreation + rl(averageLimitOrderLifespanNS), 0);
-					if (p < ask) {
-						ask = p;
-					}
-				}
-				else {
-					// Create a buy limit order below the ask.
-					u32 p = ask - rl(averageLimitOrderDistance);
-					addLimitOrder(p, rl(averageLimitOrderSize), nextOrderCreation + rl(averageLimitOrderLifespanNS), 0);
-					if (p > bid) {
-						bid = p;
-					}
-				}
-			}
+	// Outside the range only market orders are left on one side, so widen it until they are covered by the continuous book.
+	while (totalSells < marketBuys && hi + 1 < NUM_PRICES) {
+		hi++;
+		auctionBuyLevel[hi] = 0;
+		auctionSellLevel[hi] = continuousLevelVolume(hi, t);
+		totalSells += auctionSellLevel[hi];
+	}
+	while (totalBuys < marketSells && lo > 0) {
+		lo--;
+		auctionBuyLevel[lo] = continuousLevelVolume(lo, t);
+		auctionSellLevel[lo] = 0;
+		totalBuys += auctionBuyLevel[lo];
+	}
 
-			// Randomly generate the next order creation time.
-			u64 delta = rl(averageOrderCreationDeltaNS);
-			nextOrderCreation += delta;
-		}
-		else {
+	// Accumulate the depth willing to trade at each price.
+	u32 d = marketBuys;
+	for (u32 p = hi; p >= lo && p != UINT_MAX; p--) {
+		d += auctionBuyLevel[p];
+		auctionBuyDepth[p] = d;
+	}
+	u32 s = marketSells;
+	for (u32 p = lo; p <= hi; p++) {
+		s += auctionSellLevel[p];
+		auctionSellDepth[p] = s;
+	}
 
-			for (u32 p = 0; p < NUM_PRICES; p++) {
-				updateLimitOrders(p, targetTime);
-			}
+	// Score every price without branching so that the loop vectorizes.
+	for (u32 p = lo; p <= hi; p++) {
+		u32 bd = auctionBuyDepth[p];
+		u32 sd = auctionSellDepth[p];
+		u32 v = bd < sd ? bd : sd;
+		u32 imbalance = (bd < sd ? sd : bd) - v;
+		auctionKey[p] = ((u64)v << 32) | (u64)(u32)~imbalance;
+	}
 
-			updateBidAndAsk();
+	// Take the best score, breaking ties by distance from the midpoint.
+	u32 mid = (bid + ask) / 2;
+	u32 best = lo;
+	u32 bestDistance = lo > mid ? lo - mid : mid - lo;
+	for (u32 p = lo + 1; p <= hi; p++) {
+		u32 distance = p > mid ? p - mid : mid - p;
+		if (auctionKey[p] > auctionKey[best] || (auctionKey[p] == auctionKey[best] && distance < bestDistance)) {
+			best = p;
+			bestDistance = distance;
+		}
+	}
 
-			// Print the market.
-			clearConsole();
-			printOrderBook();
+	*price = best;
+	*low = lo;
+	*high = hi;
+	return (u32)(auctionKey[best] >> 32);
+}
 
-			// Collect the user's input.
-			bool buyMarket = 0, sellMarket = 0, buyLimit = 0, sellLimit = 0, tab = 0, enter = 0, backspace = 0;
-			bool number[10] = { 0,0,0,0,0,0,0,0,0,0 };
-			while (_kbhit()) {
-				int c = _getch();
-				switch (c) {
-				case 46: // .
-					buyMarket = 1;
-					break;
-				case 47: // /
-					sellMarket = 1;
-					break;
-				case 59: // ;
-					buyLimit = 1;
-					break;
-				case 39: // '
-					sellLimit = 1;
-					break;
-				case 9: // TAB
-					tab = 1;
-					break;
-				case 13: // ENTER
-					enter = 1;
-					break;
-				case 8: // BACKSPACE
-					backspace = 1;
-					break;
-				case 27: // ESC
-					exit(0);
-					break;
-				}
+// Reverse a queue, putting a newest-first auction queue into time priority.
+void reverseQueue(limitOrder** head) {
+	limitOrder* prev = NULL;
+	limitOrder* curr = *head;
+	while (curr != NULL) {
+		limitOrder* next = curr->next;
+		curr->next = prev;
+		prev = curr;
+		curr = next;
+	}
+	*head = prev;
+}
 
-				if (c >= 48 && c < 58) {
-					number[c - 48] = 1;
-				}
-			}
+// Fill orders from the front of a queue at the uncrossing price until size becomes 0.
+void fillAuctionQueue(limitOrder** head, u32* size, u32 price, bool isBuy, bool isMarket) {
+	while (*size > 0 && *head != NULL) {
+		limitOrder* curr = *head;
+		u32 s = curr->size < *size ? curr->size : *size;
+		bool complete = s == curr->size;
+		*size -= s;
+		curr->size -= s;
 
-			if (buyMarket) {
-				// Execute the user's market buy order.
-				if (realisticUserMarketOrders) {
-					balance -= marketBuy(userMarketBuySize, targetTime);
-				}
-				else {
-					balance -= userMarketBuySize * ask;
-				}
-				sharesOpen += userMarketBuySize;
-				
+		if (complete) {
+			publish(*head, curr->next);
+			freeLimitOrder(curr);
+		}
+
+		if (curr->user) {
+			if (!isMarket) {
+				fillUserLimitOrder(curr, s, price, isBuy, complete);
 			}
-			if (sellMarket) {
-				// Execute the user's market sell order.
-				if(realisticUserMarketOrders){
-					balance += marketSell(userMarketSellSize, targetTime);
-				}
-				else {
-					balance += userMarketSellSize * bid;
-				}
-				sharesOpen -= userMarketSellSize;
+			else if (isBuy) {
+				balance -= s * price;
+				sharesOpen += s;
+				userAuctionBuyShares -= s;
+				strategyFill(price, s, 1);
 			}
-			if (numUserLimitOrders < MAX_NUM_USER_LIMIT_ORDERS) {
-				if (buyLimit) {
-					// Create a limit buy order.
-					addLimitOrder(bid, userLimitBuySize, ULLONG_MAX, 1);
-				}
-				else if (sellLimit) {
-					// Create a limit sell order.
-					addLimitOrder(ask, userLimitSellSize, ULLONG_MAX, 1);
-				}
+			else {
+				balance += s * price;
+				sharesOpen -= s;
+				userAuctionSellShares -= s;
+				strategyFill(price, s, 0);
 			}
+		}
+	}
+}
 
-			if (userEditing) {
-				for (int i = 0; i < 10; i++) {
-					if (number[i] && userEditingNumber < 100000000) {
-						userEditingNumber *= 10;
-						userEditingNumber += i;
-					}
-				}
-				if (tab || enter) {
-					userEditing = 0;
-					switch (userSelected) {
-					case 0:
-						userMarketBuySize = userEditingNumber;
-						userMarketSellSize = userEditingNumber;
-						userLimitBuySize = userEditingNumber;
-						userLimitSellSize = userEditingNumber;
-						break;
-					case 1:
-						userMarketBuySize = userEditingNumber;
-						break;
-					case 2:
-						userMarketSellSize = userEditingNumber;
-						break;
-					case 3:
-						userLimitBuySize = userEditingNumber;
-						break;
-					case 4:
-						userLimitSellSize = userEditingNumber;
-						break;
-					}
-				}
-				if (tab) {
-					userSelected = (userSelected + 1) % 5;
-				}
-			}
-			else {
-				if (tab) {
-					userSelected = (userSelected + 1) % 5;
-				}
-				if (enter) {
-					userEditing = 1;
-					userEditingNumber = 0;
-				}
+// Move every order from one queue to the back of another.
+void appendQueue(limitOrder** dst, limitOrder** src) {
+	if (*src == NULL) return;
+	while (*dst != NULL) {
+		dst = &(*dst)->next;
+	}
+	publish(*dst, *src);
+	*src = NULL;
+}
+
+// End an auction at time t: execute every crossing order at the uncrossing price and move what is left into the continuous book.
+void uncrossAuction(u64 t) {
+	u32 price, lo, hi;
+	u32 volume = findUncrossPrice(t, &price, &lo, &hi);
+
+	reverseQueue(&auctionMarketBuyHead);
+	reverseQueue(&auctionMarketSellHead);
+	for (u32 p = lo; p <= hi; p++) {
+		reverseQueue(&auctionBuyHead[p]);
+		reverseQueue(&auctionSellHead[p]);
+	}
+
+	// Allocate the volume to each side in price and then time priority, with market orders first.
+	// Orders already resting in the continuous book keep their priority over orders entered during the auction.
+	if (volume > 0) {
+		u32 x = volume;
+		fillAuctionQueue(&auctionMarketBuyHead, &x, price, 1, 1);
+		for (u32 p = hi; x > 0 && p >= price && p != UINT_MAX; p--) {
+			if (p <= bid) {
+				fillAuctionQueue(&limitOrderHead[p], &x, price, 1, 0);
+				recountLevel(p);
 			}
+			fillAuctionQueue(&auctionBuyHead[p], &x, price, 1, 0);
+		}
 
-			if (backspace) {
-				// Remove the user's limit orders from the order book.
-				for (int i = 0; i < numUserLimitOrders; i++) {
-					// By setting the expiration time to 0, the orders will get deleted next time they are updated.
-					userLimitOrders[i]->expirationTime = 0;
-				}
-				numUserLimitOrders = 0;
+		x = volume;
+		fillAuctionQueue(&auctionMarketSellHead, &x, price, 0, 1);
+		for (u32 p = lo; x > 0 && p <= price; p++) {
+			if (p >= ask) {
+				fillAuctionQueue(&limitOrderHead[p], &x, price, 0, 0);
+				recountLevel(p);
 			}
+			fillAuctionQueue(&auctionSellHead[p], &x, price, 0, 0);
+		}
+	}
 
-			targetTime += frameLengthNS;
+	// Market orders that did not execute are cancelled.
+	auctionQueueVolume(&auctionMarketBuyHead, ULLONG_MAX);
+	auctionQueueVolume(&auctionMarketSellHead, ULLONG_MAX);
+	userAuctionBuyShares = 0;
+	userAuctionSellShares = 0;
+
+	// Find the new bid and ask. The orders left over cannot cross, since otherwise more shares could have executed.
+	u32 newBid = 0;
+	for (u32 p = hi; p != UINT_MAX; p--) {
+		if (auctionBuyHead[p] != NULL || (p <= bid && limitOrderHead[p] != NULL)) {
+			newBid = p;
+			break;
+		}
+	}
+	u32 newAsk = NUM_PRICES - 1;
+	for (u32 p = lo; p < NUM_PRICES; p++) {
+		if (auctionSellHead[p] != NULL || (p >= ask && limitOrderHead[p] != NULL)) {
+			newAsk = p;
+			break;
+		}
+	}
 
-			// Wait until it is time to begin the next frame.
-			while (getTime() < targetTime) {}
+	for (u32 p = lo; p <= hi; p++) {
+		if (auctionBuyHead[p] != NULL || auctionSellHead[p] != NULL) {
+			appendQueue(&limitOrderHead[p], &auctionBuyHead[p]);
+			appendQueue(&limitOrderHead[p], &auctionSellHead[p]);
+			recountLevel(p);
 		}
 	}
+
+	bid = newBid;
+	ask = newAsk;
+	auctionMinPrice = UINT_MAX;
+	auctionMaxPrice = 0;
+	lastUncrossPrice = price;
+	lastUncrossVolume = volume;
 }
 
-// Initializes the market to a state where participants are already trading.
-void setupMarket(u64 startingTime) {
-	bid = rd() * (double)(initialBidMax + 1 - initialBidMin) + (double)initialBidMin;
-	u32 spread = rd() * (double)(initialSpreadMax + 1 - initialSpreadMin) + (double)initialSpreadMin;
-	ask = bid + spread;
+// The phase that updateMarketPhase will have moved the market to by time t.
+int marketPhaseAt(u64 t) {
+	if (openingAuctionLengthNS > 0 && t < sessionStartTime + openingAuctionLengthNS) {
+		return PHASE_OPENING_AUCTION;
+	}
+	if (closingAuctionStartNS > 0 && t >= sessionStartTime + closingAuctionStartNS) {
+		return t >= sessionStartTime + closingAuctionStartNS + closingAuctionLengthNS ? PHASE_CLOSED : PHASE_CLOSING_AUCTION;
+	}
+	return PHASE_CONTINUOUS;
+}
 
-	// Generate limit orders from the bid going down.
-	for (u32 p = bid; p >= bid - 10; p--) {
-		for (int k = 0; k < 10; k++) {
-			addLimitOrder(p, averageMarketOrderSize, startingTime + rl(averageLimitOrderLifespanNS), 0);
+// Move between trading phases as time passes, uncrossing the book at the end of each auction.
+void updateMarketPhase(u64 t) {
+	if (marketPhase == PHASE_OPENING_AUCTION && t >= sessionStartTime + openingAuctionLengthNS) {
+		uncrossAuction(t);
+		marketPhase = PHASE_CONTINUOUS;
+	}
+	if (marketPhase == PHASE_CONTINUOUS && closingAuctionStartNS > 0 && t >= sessionStartTime + closingAuctionStartNS) {
+		marketPhase = PHASE_CLOSING_AUCTION;
+	}
+	if (marketPhase == PHASE_CLOSING_AUCTION && t >= sessionStartTime + closingAuctionStartNS + closingAuctionLengthNS) {
+		uncrossAuction(t);
+		marketPhase = PHASE_CLOSED;
+	}
+}
+
+// Take a message from the free list, allocating another block of them if it is empty.
+orderMessage* newMessage() {
+	if (freeMessages == NULL) {
+		orderMessage* block = (orderMessage*)calloc(MESSAGE_BLOCK_SIZE, sizeof(orderMessage));
+		if (block == NULL) {
+			printf("Ran out of memory for messages in flight.\n");
+			exit(1);
 		}
+		for (int i = 0; i < MESSAGE_BLOCK_SIZE; i++) {
+			block[i].next = freeMessages;
+			freeMessages = block + i;
+		}
+	}
+	orderMessage* m = freeMessages;
+	freeMessages = m->next;
+	return m;
+}
+
+// Put a message in the wheel slot of the tick it arrives in, or in the overflow list if that is past the current rotation.
+void scheduleMessage(orderMessage* m) {
+	u64 tick = (m->arrivalTime - sessionStartTime) / wheelTickNS;
+	if (tick < wheelTick) tick = wheelTick;
+	m->next = NULL;
+
+	if (tick - wheelTick >= WHEEL_SLOTS) {
+		m->next = wheelOverflow;
+		wheelOverflow = m;
+		return;
 	}
 
-	// Generate limit orders from the ask going up.
-	for (u32 p = ask; p <= ask + 10; p++) {
-		for (int k = 0; k < 10; k++) {
-			addLimitOrder(p, averageMarketOrderSize, startingTime + rl(averageLimitOrderLifespanNS), 0);
+	u32 slot = tick & (WHEEL_SLOTS - 1);
+	if (wheelHead[slot] == NULL) {
+		wheelHead[slot] = m;
+		wheelOccupied[slot >> 6] |= (u64)1 << (slot & 63);
+	}
+	else {
+		wheelTail[slot]->next = m;
+	}
+	wheelTail[slot] = m;
+}
+
+// Move the overflow messages that arrive within the rotation starting at the current tick into the wheel.
+void refillWheel() {
+	orderMessage* curr = wheelOverflow;
+	wheelOverflow = NULL;
+	while (curr != NULL) {
+		orderMessage* next = curr->next;
+		scheduleMessage(curr);
+		curr = next;
+	}
+}
+
+void executeMessage(orderMessage* m, u64 t);
+
+// Add sign times the shares of one of the user's messages to the counter for its side. Cancels and participants' messages count for nothing.
+void countUserShares(orderMessage* m, int sign, int* buyShares, int* sellShares) {
+	if (!m->user) return;
+	if (m->type == MESSAGE_MARKET_BUY || m->type == MESSAGE_LIMIT_BUY) {
+		*buyShares += sign * (int)m->size;
+	}
+	else if (m->type == MESSAGE_MARKET_SELL || m->type == MESSAGE_LIMIT_SELL) {
+		*sellShares += sign * (int)m->size;
+	}
+}
+
+// Deliver every message arriving in a tick before time t, in tick order. Messages run at their arrival time, but never earlier than
+// the previous event or the message delivered before them: a tick's messages are kept in the order they were sent rather than the
+// order they arrive, and the tick holding the previous event may still have messages due before it, so time would otherwise go back.
+void deliverMessages(u64 t) {
+	u64 endTick = (t - sessionStartTime) / wheelTickNS;
+
+	while (wheelTick < endTick) {
+		if (numMessagesInFlight == 0) {
+			wheelTick = endTick;
+			break;
+		}
+
+		u32 slot = wheelTick & (WHEEL_SLOTS - 1);
+		if (slot == 0) {
+			refillWheel();
+		}
+
+		// Skip over empty slots a word of the bitmap at a time.
+		u64 word = wheelOccupied[slot >> 6] >> (slot & 63);
+		if (word == 0) {
+			wheelTick += 64 - (slot & 63);
+			if (wheelTick > endTick) wheelTick = endTick;
+			continue;
+		}
+		wheelTick += countTrailingZeros(word);
+		if (wheelTick >= endTick) break;
+		slot = wheelTick & (WHEEL_SLOTS - 1);
+
+		// Deliver the slot's messages in the order they were sent.
+		orderMessage* curr = wheelHead[slot];
+		wheelHead[slot] = NULL;
+		wheelOccupied[slot >> 6] &= ~((u64)1 << (slot & 63));
+		while (curr != NULL) {
+			orderMessage* next = curr->next;
+			numMessagesInFlight--;
+			countUserShares(curr, -1, &userInFlightBuyShares, &userInFlightSellShares);
+			if (curr->arrivalTime > currentTime) currentTime = curr->arrivalTime;
+			executeMessage(curr, currentTime);
+			curr->next = freeMessages;
+			freeMessages = curr;
+			curr = next;
 		}
+		wheelTick++;
 	}
 }
 
-void setup() {
-	for (int i = 0; i < NUM_PRICES; i++) {
-		limitOrderHead[i] = NULL;
+// Random delay of one message, from the latency stream.
+u64 latencyJitter() {
+	double x = (double)nextRandom(&latencyRandState) / (double)ULLONG_MAX;
+	if (uniformLatencyJitter) {
+		return (u64)(x * 2.0 * (double)latencyJitterNS);
 	}
+	return (u64)(-(double)latencyJitterNS * log(x));
+}
 
-	// Allocate poolSize limit orders and make all of them free limit orders.
-	limitOrder* lo = (limitOrder*)calloc(poolSize, sizeof(limitOrder));
-	freeLimitOrders = (limitOrder**)calloc(poolSize, sizeof(limitOrder*));
-	numFreeLimitOrders = poolSize;
-	for (int i = 0; i < poolSize; i++) {
-		freeLimitOrders[i] = lo + i;
+// Send a message to the exchange at time t. It is executed right away if it has no latency and is put in the wheel otherwise.
+void sendMessage(orderMessage* m, u64 t) {
+	u64 arrival = t + (m->user ? latencyUserNS : latencyParticipantNS);
+	if (latencyJitterNS > 0) {
+		arrival += latencyJitter();
 	}
 
-	numUserLimitOrders = 0;
-	userLimitOrders = (limitOrder**)calloc(MAX_NUM_USER_LIMIT_ORDERS, sizeof(limitOrder*));
+	// The gateway handles one message at a time in the order they reach it.
+	if (gatewayServiceNS > 0) {
+		if (arrival < gatewayFreeTime) arrival = gatewayFreeTime;
+		arrival += gatewayServiceNS;
+		gatewayFreeTime = arrival;
+	}
+
+	if (m->user && m->type != MESSAGE_CANCEL_ALL) {
+		userSharesSent += m->size;
+	}
+
+	if (arrival == t) {
+		executeMessage(m, t);
+		return;
+	}
 
-	setSeed(getTime());
+	orderMessage* d = newMessage();
+	*d = *m;
+	d->arrivalTime = arrival;
+	scheduleMessage(d);
+	numMessagesInFlight++;
+	countUserShares(d, 1, &userInFlightBuyShares, &userInFlightSellShares);
 }
 
-int main() {
-	setup();
+// Randomly draw a participant's next order. Everything but its price is drawn here, since the price depends on the book when it arrives.
+void drawParticipantMessage(orderMessage* m, bool auction) {
+	m->user = 0;
+	m->distance = 0;
+	m->crossDistance = 0;
+	m->lifespan = 0;
 
-	u64 startingTime = getTime();
-	setupMarket(startingTime);
+	// Choose a limit or market order.
+	if (rd() < marketOrderProbability) {
+		// Randomly choose a market order size and whether it is a buy or sell.
+		m->size = drawQuantity(QUANTITY_MARKET_SIZE, averageMarketOrderSize);
+		m->type = rand64() % 2 ? MESSAGE_MARKET_SELL : MESSAGE_MARKET_BUY;
+	}
+	else {
+		// Choose whether it is a buy or sell and how far it is from the other side of the book.
+		m->type = rand64() % 2 ? MESSAGE_LIMIT_SELL : MESSAGE_LIMIT_BUY;
+		m->distance = drawQuantity(QUANTITY_DISTANCE, averageLimitOrderDistance);
+		if (auction) {
+			// During an auction, orders are also priced through the other side of the book so that it crosses.
+			m->crossDistance = drawQuantity(QUANTITY_DISTANCE, averageLimitOrderDistance);
+		}
+		m->size = drawQuantity(QUANTITY_LIMIT_SIZE, averageLimitOrderSize);
+		m->lifespan = drawQuantity(QUANTITY_LIFESPAN, averageLimitOrderLifespanNS);
+	}
+}
 
-	mainCycle(startingTime);
+// Randomly generate a participant's next order.
+void generateParticipantMessage(orderMessage* m) {
+	drawParticipantMessage(m, marketPhase == PHASE_OPENING_AUCTION || marketPhase == PHASE_CLOSING_AUCTION);
 }
+
+// The participants' orders drawn ahead of time by the generator thread, in a ring with one writer and one reader.
+// The generator draws exactly what the main loop would have, in the same order, so a seed gives the same session either way.
+// Each side only publishes its position once per batch, so that the two threads rarely touch the same cache line.
+#define GENERATED_RING_SIZE 8192
+#define GENERATED_BATCH 256
+typedef struct {
+	orderMessage m;
+	u64 delta; // How long after this order the participants send the next one.
+} generatedOrder;
+generatedOrder generatedRing[GENERATED_RING_SIZE];
+struct {
+	u64 written; // Orders the generator has published.
+	char padding[56];
+	u64 read; // Orders the main loop has handed back.
+	char padding2[56];
+} generatedPositions;
+u64 generatedAvailable = 0; // The main loop's copy of written.
+u64 generatedTaken = 0; // Orders the main loop has taken, including ones not yet handed back.
+u64 generatorTime = 0; // When the next order the generator draws is sent.
+volatile bool stopGenerator = 0;
+#if defined(_WIN32)
+HANDLE generatorHandle;
+#else
+pthread_t generatorHandle;
+#endif
+
+void pinThread(int cpu);
+
+// Orders sent to the exchange from other threads, such as gateway connections or agents, through one bounded queue that any
+// number of threads write to and only the main loop reads. Each slot holds a sequence number saying whose turn it is, so that a
+// writer only has to win the slot's position and readers never lock. Messages are taken in batches and, within a batch, ordered
+// by each producer's own sequence number and then by producer, so every producer in a batch gets a turn before any gets a second
+// one, and how the writes in one batch interleaved doesn't change the order they are executed in. Which messages end up in which
+// of up to INGRESS_BATCH-message batches still depends on when they were written, so the order across batches isn't fixed.
+#define INGRESS_SIZE 4096
+#define INGRESS_BATCH 64
+#define MAX_INGRESS_PRODUCERS 64
+typedef struct {
+	u64 sequence;
+	u64 producerSequence; // How many messages this message's producer sent before it.
+	u32 producer;
+	orderMessage m;
+} ingressSlot;
+ingressSlot ingressSlots[INGRESS_SIZE];
+struct {
+	u64 tail; // Next position a producer will claim.
+	char padding[56];
+	u64 head; // Next position the main loop will read. Only the main loop touches it.
+	char padding2[56];
+} ingressPositions;
+typedef struct {
+	u64 sent;
+	u64 active; // Whether a thread holds this producer number.
+	char padding[48];
+} ingressProducer;
+ingressProducer ingressProducers[MAX_INGRESS_PRODUCERS];
+u64 numIngressProducers = 0; // Producer numbers handed out so far, counting ones that have been released.
+
+// Empty the queue. No producer may be sending while this runs.
+void resetIngress() {
+	for (u64 i = 0; i < INGRESS_SIZE; i++) {
+		ingressSlots[i].sequence = i;
+	}
+	ingressPositions.tail = 0;
+	ingressPositions.head = 0;
+	for (int i = 0; i < MAX_INGRESS_PRODUCERS; i++) {
+		ingressProducers[i].sent = 0;
+		ingressProducers[i].active = 0;
+	}
+	numIngressProducers = 0;
+}
+
+// Give the calling thread its own producer number for sending orders, reusing one that has been released if there is one.
+// A reused number carries on counting where its last holder stopped, so the order of messages still queued under it is kept.
+int registerIngressProducer() {
+	for (u64 id = 0; id < MAX_INGRESS_PRODUCERS; id++) {
+		u64 expected = 0;
+		if (loadAcquire(ingressProducers[id].active) == 0 && compareAndSwap(&ingressProducers[id].active, &expected, 1)) {
+			u64 n = loadAcquire(numIngressProducers);
+			while (n < id + 1 && !compareAndSwap(&numIngressProducers, &n, id + 1)) {}
+			return (int)id;
+		}
+	}
+	printf("ERROR: At most %d threads can be registered to send orders at once.\n", MAX_INGRESS_PRODUCERS);
+	exit(1);
+}
+
+// Give a producer number back once the thread holding it will send no more orders. Orders it already queued are still executed.
+void unregisterIngressProducer(int producer) {
+	storeRelease(ingressProducers[producer].active, 0);
+}
+
+// Queue a message from the given producer. Return 0 if the queue is full.
+bool sendIngress(int producer, orderMessage* m) {
+	u64 pos = loadAcquire(ingressPositions.tail);
+	while (1) {
+		ingressSlot* slot = &ingressSlots[pos % INGRESS_SIZE];
+		long long diff = (long long)(loadAcquire(slot->sequence) - pos);
+		if (diff == 0) {
+			if (compareAndSwap(&ingressPositions.tail, &pos, pos + 1)) {
+				slot->m = *m;
+				slot->producer = producer;
+				slot->producerSequence = ingressProducers[producer].sent++;
+				storeRelease(slot->sequence, pos + 1);
+				return 1;
+			}
+		}
+		else if (diff < 0) {
+			return 0;
+		}
+		else {
+			pos = loadAcquire(ingressPositions.tail);
+		}
+	}
+}
+
+int compareIngress(const void* a, const void* b) {
+	const ingressSlot* x = (const ingressSlot*)a;
+	const ingressSlot* y = (const ingressSlot*)b;
+	if (x->producerSequence != y->producerSequence) return x->producerSequence < y->producerSequence ? -1 : 1;
+	return x->producer < y->producer ? -1 : x->producer > y->producer;
+}
+
+// Take up to INGRESS_BATCH messages that are ready into batch, in the order they should be executed, and return how many.
+int takeIngress(ingressSlot* batch) {
+	int n = 0;
+	u64 pos = ingressPositions.head;
+	while (n < INGRESS_BATCH) {
+		ingressSlot* slot = &ingressSlots[pos % INGRESS_SIZE];
+		if (loadAcquire(slot->sequence) != pos + 1) break;
+		batch[n++] = *slot;
+		storeRelease(slot->sequence, pos + INGRESS_SIZE);
+		pos++;
+	}
+	ingressPositions.head = pos;
+	if (n > 1) {
+		qsort(batch, n, sizeof(ingressSlot), compareIngress);
+	}
+	return n;
+}
+
+// Send every message other threads have queued to the exchange at time t.
+void drainIngress(u64 t) {
+	ingressSlot batch[INGRESS_BATCH];
+	int n;
+	do {
+		n = takeIngress(batch);
+		for (int i = 0; i < n; i++) {
+			// The user's orders go through the same risk checks whichever thread sent them.
+			if (batch[i].m.user && !riskAcceptMessage(&batch[i].m, t)) continue;
+			sendMessage(&batch[i].m, t);
+		}
+	} while (n == INGRESS_BATCH);
+}
+
+// Let the other thread run while waiting on the ring.
+void yieldThread() {
+#if defined(_WIN32)
+	SwitchToThread();
+#else
+	sched_yield();
+#endif
+}
+
+#if defined(_WIN32)
+DWORD WINAPI generatorThread(LPVOID arg) {
+#else
+void* generatorThread(void* arg) {
+#endif
+	if (generatorCPU >= 0) {
+		pinThread(generatorCPU);
+	}
+	u64 written = 0, freed = 0;
+	while (!stopGenerator) {
+		if (written + GENERATED_BATCH > freed + GENERATED_RING_SIZE) {
+			freed = loadAcquire(generatedPositions.read);
+			if (written + GENERATED_BATCH > freed + GENERATED_RING_SIZE) {
+				yieldThread();
+			}
+			continue;
+		}
+		for (int i = 0; i < GENERATED_BATCH; i++) {
+			int phase = marketPhaseAt(generatorTime);
+			if (phase == PHASE_CLOSED) {
+				// The participants have stopped trading, so publish what is left of the batch and finish.
+				storeRelease(generatedPositions.written, written + i);
+				return 0;
+			}
+			generatedOrder* g = &generatedRing[(written + i) % GENERATED_RING_SIZE];
+			drawParticipantMessage(&g->m, phase == PHASE_OPENING_AUCTION || phase == PHASE_CLOSING_AUCTION);
+			g->delta = drawQuantity(QUANTITY_ARRIVAL, averageOrderCreationDeltaNS);
+			generatorTime += g->delta;
+		}
+		written += GENERATED_BATCH;
+		storeRelease(generatedPositions.written, written);
+	}
+	return 0;
+}
+
+// Start drawing the participants' orders on the generator thread, the first of them sent at time t.
+// The main loop must not draw random numbers from the participants' stream until stopGeneratorThread.
+void startGeneratorThread(u64 t) {
+	generatorTime = t;
+	generatedPositions.written = 0;
+	generatedPositions.read = 0;
+	generatedAvailable = 0;
+	generatedTaken = 0;
+	stopGenerator = 0;
+#if defined(_WIN32)
+	generatorHandle = CreateThread(NULL, 0, generatorThread, NULL, 0, NULL);
+	if (generatorHandle == NULL) {
+#else
+	if (pthread_create(&generatorHandle, NULL, generatorThread, NULL) != 0) {
+#endif
+		printf("ERROR: Could not start the generator thread.\n");
+		exit(1);
+	}
+}
+
+void stopGeneratorThread() {
+	stopGenerator = 1;
+#if defined(_WIN32)
+	WaitForSingleObject(generatorHandle, INFINITE);
+	CloseHandle(generatorHandle);
+#else
+	pthread_join(generatorHandle, NULL);
+#endif
+}
+
+// Take the next order from the generator, waiting for it if the generator has fallen behind. Return how long until the one after it.
+u64 takeGeneratedMessage(orderMessage* m) {
+	while (generatedTaken == generatedAvailable) {
+		generatedAvailable = loadAcquire(generatedPositions.written);
+		if (generatedTaken == generatedAvailable) {
+			yieldThread();
+		}
+	}
+	generatedOrder* g = &generatedRing[generatedTaken % GENERATED_RING_SIZE];
+	*m = g->m;
+	u64 delta = g->delta;
+	generatedTaken++;
+	if (generatedTaken % GENERATED_BATCH == 0) {
+		storeRelease(generatedPositions.read, generatedTaken);
+	}
+	return delta;
+}
+
+// Execute a participant's message against the book at time t.
+void executeParticipantMessage(orderMessage* m, u64 t, bool auction) {
+	switch (m->type) {
+	case MESSAGE_MARKET_BUY:
+		if (auction) {
+			addAuctionOrder(0, m->size, ULLONG_MAX, 0, 0, 1);
+		}
+		else {
+			marketBuy(m->size, t);
+		}
+		break;
+	case MESSAGE_MARKET_SELL:
+		if (auction) {
+			addAuctionOrder(0, m->size, ULLONG_MAX, 0, 1, 1);
+		}
+		else {
+			marketSell(m->size, t);
+		}
+		break;
+	case MESSAGE_LIMIT_SELL: {
+		// Create a sell limit order above the bid.
+		u32 p = bid + m->distance;
+		if (auction) {
+			p = p > m->crossDistance ? p - m->crossDistance : 0;
+			addAuctionOrder(p, m->size, t + m->lifespan, 0, 1, 0);
+		}
+		else {
+			addLimitOrder(p, m->size, t + m->lifespan, 0);
+			if (p < ask) {
+				ask = p;
+			}
+		}
+		break;
+	}
+	case MESSAGE_LIMIT_BUY: {
+		// Create a buy limit order below the ask.
+		u32 p = ask - m->distance;
+		if (auction) {
+			p = p + m->crossDistance < NUM_PRICES ? p + m->crossDistance : NUM_PRICES - 1;
+			addAuctionOrder(p, m->size, t + m->lifespan, 0, 0, 0);
+		}
+		else {
+			addLimitOrder(p, m->size, t + m->lifespan, 0);
+			if (p > bid) {
+				bid = p;
+			}
+		}
+		break;
+	}
+	}
+}
+
+// Execute one of the user's messages against the book at time t.
+void executeUserMessage(orderMessage* m, u64 t, bool auction) {
+	switch (m->type) {
+	case MESSAGE_MARKET_BUY:
+		// Execute the user's market buy order.
+		if (auction) {
+			addAuctionOrder(0, m->size, ULLONG_MAX, 1, 0, 1);
+			userAuctionBuyShares += m->size;
+		}
+		else if (realisticUserMarketOrders) {
+			userAggressor = 1;
+			u32 cost = marketBuy(m->size, t);
+			userAggressor = 0;
+			balance -= cost;
+			sharesOpen += m->size;
+			userSlippage += (long long)cost - (long long)m->size * m->referencePrice;
+			userMarketSharesTraded += m->size;
+		}
+		else {
+			balance -= m->size * ask;
+			sharesOpen += m->size;
+			strategyFill(ask, m->size, 1);
+		}
+		break;
+	case MESSAGE_MARKET_SELL:
+		// Execute the user's market sell order.
+		if (auction) {
+			addAuctionOrder(0, m->size, ULLONG_MAX, 1, 1, 1);
+			userAuctionSellShares += m->size;
+		}
+		else if (realisticUserMarketOrders) {
+			userAggressor = 1;
+			u32 proceeds = marketSell(m->size, t);
+			userAggressor = 0;
+			balance += proceeds;
+			sharesOpen -= m->size;
+			userSlippage += (long long)m->size * m->referencePrice - (long long)proceeds;
+			userMarketSharesTraded += m->size;
+		}
+		else {
+			balance += m->size * bid;
+			sharesOpen -= m->size;
+			strategyFill(bid, m->size, 0);
+		}
+		break;
+	case MESSAGE_LIMIT_BUY: {
+		// Create a limit buy order at the bid or at its own price, dropping it if it would cross.
+		u32 p = m->price == PRICE_AT_TOUCH ? bid : m->price;
+		if (numUserLimitOrders < MAX_NUM_USER_LIMIT_ORDERS && p < ask) {
+			if (auction) {
+				addAuctionOrder(p, m->size, ULLONG_MAX, 1, 0, 0);
+			}
+			else {
+				addLimitOrder(p, m->size, ULLONG_MAX, 1);
+				if (p > bid) {
+					bid = p;
+				}
+			}
+			userOpenBuyShares += m->size;
+		}
+		break;
+	}
+	case MESSAGE_LIMIT_SELL: {
+		// Create a limit sell order at the ask or at its own price, dropping it if it would cross.
+		u32 p = m->price == PRICE_AT_TOUCH ? ask : m->price;
+		if (numUserLimitOrders < MAX_NUM_USER_LIMIT_ORDERS && p > bid && p < NUM_PRICES) {
+			if (auction) {
+				addAuctionOrder(p, m->size, ULLONG_MAX, 1, 1, 0);
+			}
+			else {
+				addLimitOrder(p, m->size, ULLONG_MAX, 1);
+				if (p < ask) {
+					ask = p;
+				}
+			}
+			userOpenSellShares += m->size;
+		}
+		break;
+	}
+	case MESSAGE_CANCEL_ALL:
+		// Remove the user's limit orders from the order book.
+		for (int i = 0; i < numUserLimitOrders; i++) {
+			// By setting the expiration time to 0, the orders will get deleted next time they are updated.
+			userLimitOrders[i]->expirationTime = 0;
+			levelMinExpiration[userLimitOrders[i]->p] = 0;
+		}
+		numUserLimitOrders = 0;
+		userOpenBuyShares = 0;
+		userOpenSellShares = 0;
+
+		// The user's market orders waiting for the auction are cancelled too, and dropped when it uncrosses.
+		for (limitOrder* lo = auctionMarketBuyHead; lo != NULL; lo = lo->next) {
+			if (lo->user) lo->expirationTime = 0;
+		}
+		for (limitOrder* lo = auctionMarketSellHead; lo != NULL; lo = lo->next) {
+			if (lo->user) lo->expirationTime = 0;
+		}
+		userAuctionBuyShares = 0;
+		userAuctionSellShares = 0;
+		break;
+	}
+}
+
+// Execute a message that has reached the exchange at time t.
+void executeMessage(orderMessage* m, u64 t) {
+	updateMarketPhase(t);
+	if (marketPhase == PHASE_CLOSED) return;
+	bool auction = marketPhase != PHASE_CONTINUOUS;
+
+	if (m->user) {
+		executeUserMessage(m, t, auction);
+	}
+	else {
+		executeParticipantMessage(m, t, auction);
+	}
+}
+
+// Make one of the user's messages.
+orderMessage userMessage(int type, u32 size, u32 price) {
+	orderMessage m;
+	m.type = type;
+	m.size = size;
+	m.price = price;
+	m.referencePrice = (bid + ask) / 2;
+	m.user = 1;
+	m.distance = 0;
+	m.crossDistance = 0;
+	m.lifespan = 0;
+	return m;
+}
+
+// Send one of the user's orders at time t.
+void sendUserMessage(int type, u32 size, u64 t) {
+	orderMessage m = userMessage(type, size, PRICE_AT_TOUCH);
+	sendMessage(&m, t);
+}
+
+// Queue an order from the strategy to be sent after the current event, once it passes the risk checks.
+bool queueStrategyOrder(int type, u32 size, u32 price) {
+	if (numPendingStrategyOrders == MAX_PENDING_STRATEGY_ORDERS) return 0;
+	orderMessage m = userMessage(type, size, price);
+	if (!riskAcceptMessage(&m, currentTime)) return 0;
+	pendingStrategyOrders[numPendingStrategyOrders++] = m;
+	countUserShares(&m, 1, &pendingStrategyBuyShares, &pendingStrategySellShares);
+	return 1;
+}
+
+bool strategyMarketBuy(u32 size) {
+	return queueStrategyOrder(MESSAGE_MARKET_BUY, size, PRICE_AT_TOUCH);
+}
+
+bool strategyMarketSell(u32 size) {
+	return queueStrategyOrder(MESSAGE_MARKET_SELL, size, PRICE_AT_TOUCH);
+}
+
+bool strategyLimitBuy(u32 p, u32 size) {
+	if (p >= NUM_PRICES) return 0;
+	return queueStrategyOrder(MESSAGE_LIMIT_BUY, size, p);
+}
+
+bool strategyLimitSell(u32 p, u32 size) {
+	if (p >= NUM_PRICES) return 0;
+	return queueStrategyOrder(MESSAGE_LIMIT_SELL, size, p);
+}
+
+void strategyCancelAll() {
+	queueStrategyOrder(MESSAGE_CANCEL_ALL, 0, PRICE_AT_TOUCH);
+}
+
+u64 strategyNow() {
+	return currentTime;
+}
+
+// Load the strategy plugin at path and let it register its callbacks.
+void loadStrategy(const char* path) {
+	strategyLoadFunction load = NULL;
+#if defined(_WIN32)
+	HMODULE library = LoadLibraryA(path);
+	if (library != NULL) load = (strategyLoadFunction)GetProcAddress(library, STRATEGY_LOAD_SYMBOL);
+#endif
+#ifdef __linux
+	void* library = dlopen(path, RTLD_NOW | RTLD_LOCAL);
+	if (library != NULL) load = (strategyLoadFunction)dlsym(library, STRATEGY_LOAD_SYMBOL);
+#endif
+	if (load == NULL) {
+		printf("ERROR: Could not load strategy plugin %s.\n", path);
+		exit(1);
+	}
+
+	strategyView.levels = (const limitOrder* const*)limitOrderHead;
+	strategyView.numPrices = NUM_PRICES;
+	strategyView.bid = &bid;
+	strategyView.ask = &ask;
+	strategyView.balance = &balance;
+	strategyView.sharesOpen = &sharesOpen;
+	strategyView.userLimitOrders = (const limitOrder* const*)userLimitOrders;
+	strategyView.numUserLimitOrders = &numUserLimitOrders;
+	strategyView.marketPhase = &marketPhase;
+
+	strategyFunctions.marketBuy = strategyMarketBuy;
+	strategyFunctions.marketSell = strategyMarketSell;
+	strategyFunctions.limitBuy = strategyLimitBuy;
+	strategyFunctions.limitSell = strategyLimitSell;
+	strategyFunctions.cancelAll = strategyCancelAll;
+	strategyFunctions.now = strategyNow;
+
+	if (!load(STRATEGY_API_VERSION, &strategyView, &strategyFunctions, &strategy)) {
+		printf("ERROR: Strategy plugin %s refused to load.\n", path);
+		exit(1);
+	}
+	strategyLoaded = 1;
+}
+
+// Tell the strategy that the bid or ask moved.
+void strategyTopOfBook() {
+	if (strategy.onTopOfBook != NULL) {
+		strategy.onTopOfBook(strategy.state, bid, ask);
+	}
+}
+
+// Give the strategy its callbacks for everything up to time t, then send the orders it made.
+void runStrategy(u64 t) {
+	currentTime = t;
+
+	if (strategy.onTimer != NULL && strategy.timerIntervalNS > 0) {
+		if (nextStrategyTimer == 0) nextStrategyTimer = t;
+		while (nextStrategyTimer <= t) {
+			strategy.onTimer(strategy.state, nextStrategyTimer);
+			nextStrategyTimer += strategy.timerIntervalNS;
+		}
+	}
+
+	if (bid != lastNotifiedBid || ask != lastNotifiedAsk) {
+		lastNotifiedBid = bid;
+		lastNotifiedAsk = ask;
+		strategyTopOfBook();
+	}
+
+	// Orders sent while these are being executed are sent in this same loop.
+	for (int i = 0; i < numPendingStrategyOrders; i++) {
+		orderMessage m = pendingStrategyOrders[i];
+		countUserShares(&m, -1, &pendingStrategyBuyShares, &pendingStrategySellShares);
+		sendMessage(&m, t);
+	}
+	numPendingStrategyOrders = 0;
+}
+
+// Start the session clock at startingTime, opening with an auction if there is one.
+void startSession(u64 startingTime) {
+	sessionStartTime = startingTime;
+	sessionWallStart = getTime();
+	currentTime = startingTime;
+	numEvents = 0;
+	wheelTick = 0;
+	if (openingAuctionLengthNS > 0) {
+		marketPhase = PHASE_OPENING_AUCTION;
+	}
+}
+
+// Deliver every message arriving before time t and move the trading phase on. Return 0 if the market has closed.
+bool beginEvent(u64 t) {
+	if (epochReclamation) {
+		advanceEpoch();
+	}
+	deliverMessages(t);
+	currentTime = t;
+	if (numIngressProducers > 0) {
+		drainIngress(t);
+	}
+	updateMarketPhase(t);
+	return marketPhase != PHASE_CLOSED;
+}
+
+// Bring the whole book up to date at the start of the frame at time t.
+void updateFrame(u64 t) {
+	beginEvent(t);
+
+	u64 resting = 0;
+	for (u32 p = 0; p < NUM_PRICES; p++) {
+		updateLimitOrders(p, t);
+		resting += levelOrders[p];
+	}
+
+	updateBidAndAsk();
+
+	countMetric(&metrics.m.frames, 1);
+	storeRelaxed(metrics.m.restingOrders, resting);
+	storeRelaxed(metrics.m.poolHighWater, (u64)poolHighWater);
+	storeRelaxed(metrics.m.poolFree, (u64)numFreeLimitOrders + numBitmapFree);
+	storeRelaxed(metrics.m.bid, (u64)bid);
+	storeRelaxed(metrics.m.ask, (u64)ask);
+
+	if (marketPhase == PHASE_OPENING_AUCTION || marketPhase == PHASE_CLOSING_AUCTION) {
+		u32 lo, hi;
+		indicativeVolume = findUncrossPrice(t, &indicativePrice, &lo, &hi);
+	}
+}
+
+// Copy the settings in use into s.
+void saveJournalSettings(journalSettings* s) {
+	memset(s, 0, sizeof(*s));
+	s->latencyUserNS = latencyUserNS;
+	s->latencyParticipantNS = latencyParticipantNS;
+	s->latencyJitterNS = latencyJitterNS;
+	s->gatewayServiceNS = gatewayServiceNS;
+	s->wheelTickNS = wheelTickNS;
+	s->openingAuctionLengthNS = openingAuctionLengthNS;
+	s->closingAuctionStartNS = closingAuctionStartNS;
+	s->closingAuctionLengthNS = closingAuctionLengthNS;
+	s->riskMaxNotional = riskMaxNotional;
+	s->compactionIntervalNS = compactionIntervalNS;
+	s->riskMaxOrderSize = riskMaxOrderSize;
+	s->riskPriceBand = riskPriceBand;
+	s->riskMaxMessagesPerSecond = riskMaxMessagesPerSecond;
+	s->riskMaxPosition = riskMaxPosition;
+	s->compactionSliceOrders = compactionSliceOrders;
+	s->initialBidMin = initialBidMin;
+	s->initialBidMax = initialBidMax;
+	s->initialSpreadMin = initialSpreadMin;
+	s->initialSpreadMax = initialSpreadMax;
+	s->uniformLatencyJitter = uniformLatencyJitter;
+	s->realisticUserMarketOrders = realisticUserMarketOrders;
+	s->fillTiesInStackOrder = fillTiesInStackOrder;
+}
+
+// Put the settings in s in place.
+void loadJournalSettings(const journalSettings* s) {
+	latencyUserNS = s->latencyUserNS;
+	latencyParticipantNS = s->latencyParticipantNS;
+	latencyJitterNS = s->latencyJitterNS;
+	gatewayServiceNS = s->gatewayServiceNS;
+	wheelTickNS = s->wheelTickNS;
+	openingAuctionLengthNS = s->openingAuctionLengthNS;
+	closingAuctionStartNS = s->closingAuctionStartNS;
+	closingAuctionLengthNS = s->closingAuctionLengthNS;
+	riskMaxNotional = s->riskMaxNotional;
+	compactionIntervalNS = s->compactionIntervalNS;
+	riskMaxOrderSize = s->riskMaxOrderSize;
+	riskPriceBand = s->riskPriceBand;
+	riskMaxMessagesPerSecond = s->riskMaxMessagesPerSecond;
+	riskMaxPosition = s->riskMaxPosition;
+	compactionSliceOrders = s->compactionSliceOrders;
+	initialBidMin = s->initialBidMin;
+	initialBidMax = s->initialBidMax;
+	initialSpreadMin = s->initialSpreadMin;
+	initialSpreadMax = s->initialSpreadMax;
+	uniformLatencyJitter = s->uniformLatencyJitter;
+	realisticUserMarketOrders = s->realisticUserMarketOrders;
+	fillTiesInStackOrder = s->fillTiesInStackOrder;
+}
+
+// Create the journal and write its header.
+void openJournal(u64 startingTime) {
+	journalFile = fopen(journalPath, "wb");
+	if (journalFile == NULL) {
+		printf("ERROR: Could not create journal %s.\n", journalPath);
+		exit(1);
+	}
+	journalDescriptor = fileno(journalFile);
+	journalHeader h;
+	memset(&h, 0, sizeof(h));
+	h.magic = JOURNAL_MAGIC;
+	h.seed = sessionSeed;
+	h.startingTime = startingTime;
+	h.frameLengthNS = frameLengthNS;
+	saveJournalSettings(&h.settings);
+	fwrite(&h, sizeof(h), 1, journalFile);
+	countMetric(&metrics.m.journalBytes, sizeof(h));
+}
+
+// Record a participant's order sent at time t.
+void writeJournalRecord(orderMessage* m, u64 t) {
+	journalRecord r = { t, m->lifespan, m->size, m->distance, m->crossDistance, (u32)m->type };
+	fwrite(&r, sizeof(r), 1, journalFile);
+	countMetric(&metrics.m.journalBytes, sizeof(r));
+}
+
+// Record the book's fingerprint after the order sent at time t.
+void writeJournalCheckpoint(u64 t) {
+	journalRecord r = { t, bookHash, 0, 0, 0, JOURNAL_CHECKPOINT };
+	fwrite(&r, sizeof(r), 1, journalFile);
+	countMetric(&metrics.m.journalBytes, sizeof(r));
+}
+
+// The user's input for one frame, from the keyboard or from a script.
+typedef struct {
+	bool buyMarket, sellMarket, buyLimit, sellLimit, tab, enter, backspace, quit;
+	bool slower, faster; // Change the speed of the simulated clock.
+	bool pause, stepBack, stepForward, jumpBack, jumpForward; // Move through the rewind buffer.
+	bool number[10];
+	bool setSize; // A size edit from a script, applied as if it had been typed.
+	int sizeField;
+	u32 sizeValue;
+} userInput;
+
+#ifdef __linux
+// The console functions used on Windows, over the terminal. It is put in raw mode on first use so that keys arrive as they are pressed
+// without echoing, and put back on exit. ENTER and BACKSPACE arrive as they do on Windows.
+struct termios savedTerminal;
+bool terminalRaw = 0;
+
+void restoreTerminal() {
+	tcsetattr(STDIN_FILENO, TCSANOW, &savedTerminal);
+}
+
+int _kbhit() {
+	if (!terminalRaw) {
+		if (!isatty(STDIN_FILENO) || tcgetattr(STDIN_FILENO, &savedTerminal) != 0) return 0;
+		struct termios raw = savedTerminal;
+		raw.c_lflag &= ~(ICANON | ECHO);
+		raw.c_iflag &= ~ICRNL;
+		raw.c_cc[VMIN] = 1;
+		raw.c_cc[VTIME] = 0;
+		tcsetattr(STDIN_FILENO, TCSANOW, &raw);
+		atexit(restoreTerminal);
+		terminalRaw = 1;
+	}
+	struct pollfd p = { STDIN_FILENO, POLLIN, 0 };
+	return poll(&p, 1, 0) > 0;
+}
+
+int _getch() {
+	unsigned char c;
+	if (read(STDIN_FILENO, &c, 1) != 1) return EOF;
+	return c == 127 ? 8 : c;
+}
+#endif
+
+// A key read too early for the frame that read it, kept for the next one.
+int heldKey = -1;
+
+// Read every key pressed since the last frame. A key pressed again, or a second digit, is left for the next frame so that every
+// press acts once and digits are entered in the order they were typed.
+void readKeyboard(userInput* in) {
+	bool typedDigit = 0;
+	while (heldKey >= 0 || _kbhit()) {
+		int c = heldKey >= 0 ? heldKey : _getch();
+		heldKey = -1;
+		bool* flag = NULL;
+		switch (c) {
+		case 46: // .
+			flag = &in->buyMarket;
+			break;
+		case 47: // /
+			flag = &in->sellMarket;
+			break;
+		case 59: // ;
+			flag = &in->buyLimit;
+			break;
+		case 39: // '
+			flag = &in->sellLimit;
+			break;
+		case 9: // TAB
+			flag = &in->tab;
+			break;
+		case 13: // ENTER
+			flag = &in->enter;
+			break;
+		case 8: // BACKSPACE
+			flag = &in->backspace;
+			break;
+		case 27: // ESC
+			flag = &in->quit;
+			break;
+		case 91: // [
+			flag = &in->slower;
+			break;
+		case 93: // ]
+			flag = &in->faster;
+			break;
+		case 32: // SPACE
+			flag = &in->pause;
+			break;
+		case 45: // -
+			flag = &in->stepBack;
+			break;
+		case 61: // =
+			flag = &in->stepForward;
+			break;
+		case 95: // _
+			flag = &in->jumpBack;
+			break;
+		case 43: // +
+			flag = &in->jumpForward;
+			break;
+		}
+
+		bool isDigit = c >= 48 && c < 58;
+		if (isDigit) {
+			flag = &in->number[c - 48];
+		}
+		if (flag == NULL) continue;
+		if (*flag || (isDigit && typedDigit)) {
+			heldKey = c;
+			break;
+		}
+		*flag = 1;
+		typedDigit |= isDigit;
+	}
+}
+
+// Load the user's actions from userScriptPath. Each line holds a time in milliseconds since the start and an action:
+// buy, sell, limitbuy, limitsell or cancel, or size followed by all, marketbuy, marketsell, limitbuy or limitsell and the new size.
+// Lines must be in time order. Empty lines and lines starting with # are ignored, and any other line that doesn't parse is an error.
+// As with the keyboard, each action happens at most once per frame, and a size edit applies to orders from the next frame on.
+void loadUserScript() {
+	FILE* f = fopen(userScriptPath, "r");
+	if (f == NULL) {
+		printf("ERROR: Could not open user script %s.\n", userScriptPath);
+		exit(1);
+	}
+
+	char* sizeNames[5] = { "all", "marketbuy", "marketsell", "limitbuy", "limitsell" };
+	int capacity = 64;
+	userScript = (userAction*)malloc(capacity * sizeof(userAction));
+	char line[256];
+	for (int lineNumber = 1; fgets(line, sizeof(line), f) != NULL; lineNumber++) {
+		u64 ms;
+		char action[32], field[32];
+		u32 value;
+		if (line[0] == '#' || strspn(line, " \t\r\n") == strlen(line)) continue;
+		if (sscanf(line, "%llu %31s", &ms, action) != 2) {
+			printf("ERROR: Line %i of user script %s should hold a time in milliseconds and an action.\n", lineNumber, userScriptPath);
+			exit(1);
+		}
+
+		userAction a;
+		a.t = ms * 1000000;
+		a.field = 0;
+		a.value = 0;
+		if (strcmp(action, "buy") == 0) a.action = ACTION_MARKET_BUY;
+		else if (strcmp(action, "sell") == 0) a.action = ACTION_MARKET_SELL;
+		else if (strcmp(action, "limitbuy") == 0) a.action = ACTION_LIMIT_BUY;
+		else if (strcmp(action, "limitsell") == 0) a.action = ACTION_LIMIT_SELL;
+		else if (strcmp(action, "cancel") == 0) a.action = ACTION_CANCEL_ALL;
+		else if (strcmp(action, "size") == 0 && sscanf(line, "%*s %*s %31s %u", field, &value) == 2) {
+			a.action = ACTION_SIZE;
+			a.field = -1;
+			for (int i = 0; i < 5; i++) {
+				if (strcmp(field, sizeNames[i]) == 0) a.field = i;
+			}
+			a.value = value;
+		}
+		else a.action = -1;
+
+		if (a.action == -1 || a.field == -1) {
+			printf("ERROR: Unknown action on line %i of user script %s.\n", lineNumber, userScriptPath);
+			exit(1);
+		}
+		if (numUserScriptActions > 0 && a.t < userScript[numUserScriptActions - 1].t) {
+			printf("ERROR: Line %i of user script %s is out of time order.\n", lineNumber, userScriptPath);
+			exit(1);
+		}
+
+		if (numUserScriptActions == capacity) {
+			capacity *= 2;
+			userScript = (userAction*)realloc(userScript, capacity * sizeof(userAction));
+		}
+		userScript[numUserScriptActions++] = a;
+	}
+	fclose(f);
+}
+
+// Add every scripted action due by time t to this frame's input.
+void readUserScript(userInput* in, u64 t) {
+	while (nextUserScriptAction < numUserScriptActions && sessionStartTime + userScript[nextUserScriptAction].t <= t) {
+		userAction* a = &userScript[nextUserScriptAction++];
+		switch (a->action) {
+		case ACTION_MARKET_BUY:
+			in->buyMarket = 1;
+			break;
+		case ACTION_MARKET_SELL:
+			in->sellMarket = 1;
+			break;
+		case ACTION_LIMIT_BUY:
+			in->buyLimit = 1;
+			break;
+		case ACTION_LIMIT_SELL:
+			in->sellLimit = 1;
+			break;
+		case ACTION_CANCEL_ALL:
+			in->backspace = 1;
+			break;
+		case ACTION_SIZE:
+			in->setSize = 1;
+			in->sizeField = a->field;
+			in->sizeValue = a->value;
+			break;
+		}
+	}
+}
+
+// Act on the user's input for the frame at time t.
+void handleUserInput(userInput* in, u64 targetTime) {
+	if (in->setSize) {
+		// Edit the size exactly as if it had been selected, typed and entered.
+		userSelected = in->sizeField;
+		userEditing = 1;
+		userEditingNumber = in->sizeValue;
+		in->enter = 1;
+	}
+
+	// Send the user's orders through the risk checks.
+	if (in->buyMarket && riskAccept(1, userMarketBuySize, ask, targetTime)) {
+		sendUserMessage(MESSAGE_MARKET_BUY, userMarketBuySize, targetTime);
+	}
+	if (in->sellMarket && riskAccept(0, userMarketSellSize, bid, targetTime)) {
+		sendUserMessage(MESSAGE_MARKET_SELL, userMarketSellSize, targetTime);
+	}
+	if (in->buyLimit) {
+		if (riskAccept(1, userLimitBuySize, bid, targetTime)) {
+			sendUserMessage(MESSAGE_LIMIT_BUY, userLimitBuySize, targetTime);
+		}
+	}
+	else if (in->sellLimit) {
+		if (riskAccept(0, userLimitSellSize, ask, targetTime)) {
+			sendUserMessage(MESSAGE_LIMIT_SELL, userLimitSellSize, targetTime);
+		}
+	}
+
+	if (userEditing) {
+		for (int i = 0; i < 10; i++) {
+			if (in->number[i] && userEditingNumber < 100000000) {
+				userEditingNumber *= 10;
+				userEditingNumber += i;
+			}
+		}
+		if (in->tab || in->enter) {
+			userEditing = 0;
+			switch (userSelected) {
+			case 0:
+				userMarketBuySize = userEditingNumber;
+				userMarketSellSize = userEditingNumber;
+				userLimitBuySize = userEditingNumber;
+				userLimitSellSize = userEditingNumber;
+				break;
+			case 1:
+				userMarketBuySize = userEditingNumber;
+				break;
+			case 2:
+				userMarketSellSize = userEditingNumber;
+				break;
+			case 3:
+				userLimitBuySize = userEditingNumber;
+				break;
+			case 4:
+				userLimitSellSize = userEditingNumber;
+				break;
+			}
+		}
+		if (in->tab) {
+			userSelected = (userSelected + 1) % 5;
+		}
+	}
+	else {
+		if (in->tab) {
+			userSelected = (userSelected + 1) % 5;
+		}
+		if (in->enter) {
+			userEditing = 1;
+			userEditingNumber = 0;
+		}
+	}
+
+	if (in->backspace) {
+		sendUserMessage(MESSAGE_CANCEL_ALL, 0, targetTime);
+	}
+}
+
+// Print how the session ended and how fast it ran.
+void printSessionSummary() {
+	double wallSeconds = (double)(getTime() - sessionWallStart) / 1e9;
+	double simulatedSeconds = (double)(currentTime - sessionStartTime) / 1e9;
+	char s0[100];
+	char* s1;
+	printf("Seed: %llu\n", sessionSeed);
+	printf("Events: %llu in %.3f s simulated, %.3f s wall (%.0f events/s)\n", numEvents, simulatedSeconds, wallSeconds, wallSeconds > 0 ? numEvents / wallSeconds : 0.0);
+	s1 = priceToString(bid, s0);
+	*s1 = 0;
+	printf("Bid: %s  ", s0);
+	s1 = priceToString(ask, s0);
+	*s1 = 0;
+	printf("Ask: %s\n", s0);
+	s1 = priceToString(balance, s0);
+	*s1 = 0;
+	printf("Balance: %s  Shares open: %i  Shares traded: %llu\n", s0, sharesOpen, userSharesTraded);
+	s1 = priceToString(balance + sharesOpen * (int)((bid + ask) / 2), s0);
+	*s1 = 0;
+	printf("PnL at the midpoint: %s\n", s0);
+}
+
+// End the session: let the strategy clean up, finish the journal and, in headless runs, print a summary.
+void endSession() {
+	if (strategy.onUnload != NULL) {
+		strategy.onUnload(strategy.state);
+	}
+	if (journalFile != NULL) {
+		fclose(journalFile);
+	}
+	if (headless) {
+		printSessionSummary();
+	}
+	exit(0);
+}
+
+// Create the participant order sent at *nextOrderCreation and move it on to the time of the next one.
+void participantEvent(u64* nextOrderCreation) {
+	u64 began = metricsPort > 0 ? getTime() : 0;
+	u64 t = *nextOrderCreation;
+	if (!beginEvent(t)) {
+		// Participants stop trading once the closing auction is over.
+		*nextOrderCreation = ULLONG_MAX;
+		return;
+	}
+
+	orderMessage m;
+	u64 delta;
+	if (pipelineGeneration) {
+		delta = takeGeneratedMessage(&m);
+	}
+	else {
+		generateParticipantMessage(&m);
+		delta = drawQuantity(QUANTITY_ARRIVAL, averageOrderCreationDeltaNS);
+	}
+	if (journalFile != NULL) {
+		writeJournalRecord(&m, t);
+	}
+	sendMessage(&m, t);
+	numEvents++;
+	if (journalFile != NULL && journalHashInterval > 0 && numEvents % journalHashInterval == 0) {
+		writeJournalCheckpoint(t);
+	}
+
+	if (strategyLoaded) {
+		runStrategy(t);
+	}
+	compactStep(t);
+
+	*nextOrderCreation = t + delta;
+	countMetric(&metrics.m.events, 1);
+	if (metricsPort > 0) {
+		u64 took = getTime() - began;
+		int b = 0;
+		while (b < LATENCY_BUCKETS - 1 && took >> b != 0) b++;
+		countMetric(&metrics.m.latency[b], 1);
+		countMetric(&metrics.m.latencySum, took);
+	}
+}
+
+// Perform the main cycle of creating limit and market orders, deleting orders, and handling the user's orders.
+void mainCycle(u64 startingTime) {
+
+	// Initialize the process.
+	u64 nextOrderCreation = startingTime;
+	u64 targetTime = startingTime;
+	startSession(startingTime);
+	if (pipelineGeneration) {
+		startGeneratorThread(startingTime);
+	}
+
+	// The simulated time the clock has reached. It runs timeScale times as fast as the wall clock, while the book is printed
+	// and the keyboard read every frameLengthNS of wall time. Headless runs don't follow the clock.
+	u64 clockTime = startingTime;
+	u64 lastWallTime = getTime();
+	u64 nextRender = lastWallTime;
+	int sliceWork = 0;
+	bool sliceOver = 0;
+
+	// The keys read at each printed frame since the last frame of simulated time. At slow speeds several frames are printed
+	// for each simulated one, and each keeps its own keys so that pressing one twice acts twice.
+	#define MAX_QUEUED_INPUTS 64
+	userInput queuedInputs[MAX_QUEUED_INPUTS];
+	int numQueuedInputs = 0;
+	userInput noInput;
+	memset(&noInput, 0, sizeof(noInput));
+
+	while (1) {
+
+		if (!headless) {
+			u64 nextWork = nextOrderCreation < targetTime ? nextOrderCreation : targetTime;
+			// Check the wall clock every so often, so that high speeds end their slice of work in time to print the next frame.
+			if (++sliceWork % 64 == 0 && getTime() >= nextRender) {
+				sliceOver = 1;
+			}
+			if (nextWork > clockTime || sliceOver || rewinding) {
+				// Caught up with the clock, or out of time for this slice. Print the market and read the keyboard.
+				clockBehind = sliceOver;
+				if (sliceOver) {
+					countMetric(&metrics.m.frameOverruns, 1);
+				}
+				clearConsole();
+				if (rewinding) {
+					printRewind();
+				}
+				else {
+					printOrderBook();
+				}
+				userInput keys = noInput;
+				readKeyboard(&keys);
+				if (keys.quit) {
+					endSession();
+				}
+				if (keys.slower && timeScaleIndex > 0) timeScaleIndex--;
+				if (keys.faster && timeScaleIndex < NUM_TIME_SCALES - 1) timeScaleIndex++;
+				keys.slower = 0;
+				keys.faster = 0;
+
+				// Trading pauses while the user looks back through the rewind buffer.
+				long long framesPer10s = 10000000000 / frameLengthNS;
+				if (keys.pause) {
+					if (rewinding) rewinding = 0;
+					else stepRewind(0);
+				}
+				if (keys.stepBack) stepRewind(-1);
+				if (keys.stepForward) stepRewind(1);
+				if (keys.jumpBack) stepRewind(-framesPer10s);
+				if (keys.jumpForward) stepRewind(framesPer10s);
+				if (!rewinding && !keys.pause && numQueuedInputs < MAX_QUEUED_INPUTS) {
+					keys.stepBack = keys.stepForward = keys.jumpBack = keys.jumpForward = 0;
+					if (memcmp(&keys, &noInput, sizeof(keys)) != 0) {
+						queuedInputs[numQueuedInputs++] = keys;
+					}
+				}
+
+				// Wait until it is time to print the next frame, then move the clock on.
+				while (getTime() < nextRender) {}
+				u64 now = getTime();
+				nextRender += frameLengthNS;
+				if (nextRender < now) nextRender = now;
+				double step = rewinding ? 0 : (double)(now - lastWallTime) * timeScales[timeScaleIndex];
+				lastWallTime = now;
+				clockTime += (u64)step;
+
+				// When the engine can't keep up, let the clock slip rather than fall further and further behind.
+				if (clockBehind && clockTime > nextWork + (u64)step) {
+					clockTime = nextWork + (u64)step;
+				}
+				sliceWork = 0;
+				sliceOver = 0;
+				continue;
+			}
+		}
+
+		// Do the next order creation.
+		if (nextOrderCreation < targetTime) {
+			participantEvent(&nextOrderCreation);
+		}
+		else {
+
+			updateFrame(targetTime);
+
+			// Apply the keys pressed since the last frame of simulated time, one printed frame at a time, and then the script's actions.
+			for (int i = 0; i < numQueuedInputs; i++) {
+				handleUserInput(&queuedInputs[i], targetTime);
+			}
+			numQueuedInputs = 0;
+			userInput in = noInput;
+			if (userScript != NULL) {
+				readUserScript(&in, targetTime);
+			}
+			if (in.quit) {
+				endSession();
+			}
+			handleUserInput(&in, targetTime);
+
+			if (strategyLoaded) {
+				runStrategy(targetTime);
+			}
+			compactStep(targetTime);
+			if (!headless && rewindBufferBytes > 0) {
+				recordRewindFrame(targetTime);
+			}
+
+			targetTime += frameLengthNS;
+
+			if (headless) {
+				if (targetTime - startingTime > headlessDurationNS) {
+					endSession();
+				}
+			}
+		}
+	}
+}
+
+// Initializes the market to a state where participants are already trading.
+void setupMarket(u64 startingTime) {
+	bid = rd() * (double)(initialBidMax + 1 - initialBidMin) + (double)initialBidMin;
+	u32 spread = rd() * (double)(initialSpreadMax + 1 - initialSpreadMin) + (double)initialSpreadMin;
+	ask = bid + spread;
+
+	// Generate limit orders from the bid going down.
+	for (u32 p = bid; p >= bid - 10; p--) {
+		for (int k = 0; k < 10; k++) {
+			addLimitOrder(p, averageMarketOrderSize, startingTime + rl(averageLimitOrderLifespanNS), 0);
+		}
+	}
+
+	// Generate limit orders from the ask going up.
+	for (u32 p = ask; p <= ask + 10; p++) {
+		for (int k = 0; k < 10; k++) {
+			addLimitOrder(p, averageMarketOrderSize, startingTime + rl(averageLimitOrderLifespanNS), 0);
+		}
+	}
+}
+
+// Empty the book and reset the user's account, returning every order and message in flight to its free list.
+void resetBook() {
+	for (int i = 0; i < NUM_PRICES; i++) {
+		limitOrderHead[i] = NULL;
+		levelTail[i] = NULL;
+		levelVolume[i] = 0;
+		levelUserOrders[i] = 0;
+		levelMinExpiration[i] = ULLONG_MAX;
+		levelOrders[i] = 0;
+		auctionBuyHead[i] = NULL;
+		auctionSellHead[i] = NULL;
+	}
+	auctionMarketBuyHead = NULL;
+	auctionMarketSellHead = NULL;
+	auctionMinPrice = UINT_MAX;
+	auctionMaxPrice = 0;
+
+	// Every order is now unused, so the free list can simply be emptied. Committed memory stays committed.
+	numFreeLimitOrders = 0;
+	freeChain = NULL;
+	memset(levelHash, 0, sizeof(levelHash));
+	bookHash = 0;
+	nextOrderId = 0;
+	for (int b = 0; b < 3; b++) {
+		numLimboOrders[b] = 0;
+		numLimboSegments[b] = 0;
+	}
+	memset(poolBitmap, 0, ((u64)poolHighWater + 63) / 64 * sizeof(u64));
+	numBitmapFree = 0;
+	bitmapCursor = 0;
+	poolHighWater = 0;
+	compactActive = 0;
+	compactLevelActive = 0;
+	compactPrev = NULL;
+	nextCompaction = 0;
+
+	for (int i = 0; i < WHEEL_SLOTS; i++) {
+		if (wheelHead[i] != NULL) {
+			wheelTail[i]->next = freeMessages;
+			freeMessages = wheelHead[i];
+			wheelHead[i] = NULL;
+		}
+	}
+	memset(wheelOccupied, 0, sizeof(wheelOccupied));
+	while (wheelOverflow != NULL) {
+		orderMessage* next = wheelOverflow->next;
+		wheelOverflow->next = freeMessages;
+		freeMessages = wheelOverflow;
+		wheelOverflow = next;
+	}
+	numMessagesInFlight = 0;
+	userInFlightBuyShares = 0;
+	userInFlightSellShares = 0;
+	gatewayFreeTime = 0;
+
+	bid = 0;
+	ask = UINT_MAX;
+	marketPhase = PHASE_CONTINUOUS;
+	numUserLimitOrders = 0;
+	balance = 0;
+	sharesOpen = 0;
+	userOpenBuyShares = 0;
+	userOpenSellShares = 0;
+	userAuctionBuyShares = 0;
+	userAuctionSellShares = 0;
+	userSharesSent = 0;
+	userSharesTraded = 0;
+	userSlippage = 0;
+	userMarketSharesTraded = 0;
+	riskWindowStart = 0;
+	riskWindowMessages = 0;
+	numRiskRejects = 0;
+	numPendingStrategyOrders = 0;
+	pendingStrategyBuyShares = 0;
+	pendingStrategySellShares = 0;
+	nextStrategyTimer = 0;
+	lastNotifiedBid = 0;
+	lastNotifiedAsk = 0;
+}
+
+#ifdef __linux
+cpu_set_t startingAffinity; // The CPUs the process was allowed to run on when it started.
+bool startingAffinitySaved = 0;
+#endif
+
+// Page sizes for allocateMemory. Each falls back to the one before it if the system can't provide it.
+enum { HUGE_PAGES_NONE, HUGE_PAGES_TRANSPARENT, HUGE_PAGES_EXPLICIT };
+char* hugePagesText[3] = { "4 KB pages", "Transparent huge pages", "Explicit huge pages" };
+#define HUGE_PAGE_SIZE ((u64)2 << 20)
+
+// Allocate size bytes of zeroed memory backed by the page size in *mode, which is set to the page size actually used.
+// With reserveOnly, the memory is only reserved address space and must be committed with commitMemory before it is used.
+// On Linux, explicit huge pages need a reserved pool (vm.nr_hugepages), and transparent ones are only advised and may be split later.
+// On Windows, any huge page mode asks for large pages, which need the Lock Pages in Memory privilege and are always committed at once.
+void* allocateMemory(u64 size, int* mode, bool reserveOnly) {
+	void* p = NULL;
+#if defined(_WIN32)
+	if (*mode != HUGE_PAGES_NONE) {
+		SIZE_T large = GetLargePageMinimum();
+		if (large > 0) {
+			SIZE_T rounded = (size + large - 1) / large * large;
+			p = VirtualAlloc(NULL, rounded, MEM_RESERVE | MEM_COMMIT | MEM_LARGE_PAGES, PAGE_READWRITE);
+		}
+		if (p != NULL) {
+			*mode = HUGE_PAGES_EXPLICIT;
+			return p;
+		}
+	}
+	*mode = HUGE_PAGES_NONE;
+	p = VirtualAlloc(NULL, size, reserveOnly ? MEM_RESERVE : MEM_RESERVE | MEM_COMMIT, PAGE_READWRITE);
+#elif defined(__linux)
+	// Linux only gives anonymous memory pages when they are first touched, so reserving just skips the commit charge.
+	int flags = MAP_PRIVATE | MAP_ANONYMOUS | (reserveOnly ? MAP_NORESERVE : 0);
+	u64 rounded = (size + HUGE_PAGE_SIZE - 1) / HUGE_PAGE_SIZE * HUGE_PAGE_SIZE;
+	if (*mode == HUGE_PAGES_EXPLICIT) {
+		p = mmap(NULL, rounded, PROT_READ | PROT_WRITE, flags | MAP_HUGETLB, -1, 0);
+		if (p != MAP_FAILED) return p;
+		*mode = HUGE_PAGES_TRANSPARENT;
+	}
+	if (*mode == HUGE_PAGES_TRANSPARENT) {
+		// Map an extra huge page and trim the ends so that the block starts on a huge page boundary.
+		char* raw = (char*)mmap(NULL, rounded + HUGE_PAGE_SIZE, PROT_READ | PROT_WRITE, flags, -1, 0);
+		if (raw != MAP_FAILED) {
+			char* aligned = (char*)(((u64)raw + HUGE_PAGE_SIZE - 1) / HUGE_PAGE_SIZE * HUGE_PAGE_SIZE);
+			if (aligned > raw) munmap(raw, aligned - raw);
+			munmap(aligned + rounded, raw + HUGE_PAGE_SIZE - aligned);
+			if (madvise(aligned, rounded, MADV_HUGEPAGE) == 0) return aligned;
+			munmap(aligned, rounded);
+		}
+	}
+	*mode = HUGE_PAGES_NONE;
+	p = mmap(NULL, size, PROT_READ | PROT_WRITE, flags, -1, 0);
+	if (p == MAP_FAILED) p = NULL;
+#else
+	*mode = HUGE_PAGES_NONE;
+	p = calloc(1, size);
+#endif
+	if (p == NULL) {
+		printf("ERROR: Could not allocate %llu bytes.\n", size);
+		exit(1);
+	}
+	return p;
+}
+
+// Commit part of a block reserved by allocateMemory, given the mode it set.
+void commitMemory(void* p, u64 size, int mode) {
+#if defined(_WIN32)
+	if (mode == HUGE_PAGES_NONE && VirtualAlloc(p, size, MEM_COMMIT, PAGE_READWRITE) == NULL) {
+		printf("ERROR: Could not commit %llu bytes.\n", size);
+		exit(1);
+	}
+#endif
+}
+
+// Free memory from allocateMemory, given the size and the mode it set.
+void freeMemory(void* p, u64 size, int mode) {
+#if defined(_WIN32)
+	VirtualFree(p, 0, MEM_RELEASE);
+#elif defined(__linux)
+	if (mode != HUGE_PAGES_NONE) size = (size + HUGE_PAGE_SIZE - 1) / HUGE_PAGE_SIZE * HUGE_PAGE_SIZE;
+	munmap(p, size);
+#else
+	free(p);
+#endif
+}
+
+// Sum the volume within 10 levels of each side of the touch, without ever stopping the main loop.
+u64 readBookDepth(int id) {
+	readerEnter(id);
+	u32 b = *(volatile u32*)&bid;
+	u32 a = *(volatile u32*)&ask;
+	u32 lo = b >= 9 ? b - 9 : 0;
+	u32 hi = a < NUM_PRICES - 9 ? a + 9 : NUM_PRICES - 1;
+	if (b >= NUM_PRICES) lo = hi > 18 ? hi - 18 : 0;
+	if (a >= NUM_PRICES) hi = lo + 18 < NUM_PRICES ? lo + 18 : NUM_PRICES - 1;
+	u64 depth = 0;
+	for (u32 p = lo; p <= hi; p++) {
+		for (limitOrder* curr = readPublished(limitOrderHead[p]); curr != NULL; curr = readPublished(curr->next)) {
+			depth += *(volatile u32*)&curr->size;
+		}
+	}
+	readerExit(id);
+	return depth;
+}
+
+#if defined(_WIN32)
+DWORD WINAPI bookReaderThread(LPVOID arg) {
+#else
+void* bookReaderThread(void* arg) {
+#endif
+	int id = (int)(size_t)arg;
+	while (!stopBookReaders) {
+		bookReaders[id].depth = readBookDepth(id);
+		bookReaders[id].passes++;
+#if defined(_WIN32)
+		Sleep((DWORD)(bookReaderSleepUS / 1000));
+#else
+		usleep(bookReaderSleepUS);
+#endif
+	}
+	return 0;
+}
+
+// Start n threads reading the live book. From now on, orders that leave the book are only reused once no reader can see them.
+void startBookReaders(int n) {
+	if (n > MAX_BOOK_READERS) {
+		printf("ERROR: At most %d book readers can run at once.\n", MAX_BOOK_READERS);
+		exit(1);
+	}
+	epochReclamation = 1;
+	stopBookReaders = 0;
+	for (int i = 0; i < n; i++) {
+		memset(&bookReaders[i], 0, sizeof(bookReader));
+		numBookReaders++;
+#if defined(_WIN32)
+		bookReaderHandles[i] = CreateThread(NULL, 0, bookReaderThread, (LPVOID)(size_t)i, 0, NULL);
+		if (bookReaderHandles[i] == NULL) {
+#else
+		if (pthread_create(&bookReaderHandles[i], NULL, bookReaderThread, (void*)(size_t)i) != 0) {
+#endif
+			printf("ERROR: Could not start book reader %d.\n", i);
+			exit(1);
+		}
+	}
+}
+
+// Stop every book reader and return the orders still in limbo to the free list.
+void stopAllBookReaders() {
+	stopBookReaders = 1;
+	for (int i = 0; i < numBookReaders; i++) {
+#if defined(_WIN32)
+		WaitForSingleObject(bookReaderHandles[i], INFINITE);
+		CloseHandle(bookReaderHandles[i]);
+#else
+		pthread_join(bookReaderHandles[i], NULL);
+#endif
+	}
+	numBookReaders = 0;
+	epochReclamation = 0;
+	for (int b = 0; b < 3; b++) {
+		emptyLimbo(b);
+	}
+}
+
+// Pin the calling thread to one CPU. With cpu -1, let it run on any CPU the process started with again.
+void pinThread(int cpu) {
+#if defined(_WIN32)
+	DWORD_PTR processMask, systemMask;
+	GetProcessAffinityMask(GetCurrentProcess(), &processMask, &systemMask);
+	DWORD_PTR mask = cpu < 0 ? processMask : (DWORD_PTR)1 << cpu;
+	if (SetThreadAffinityMask(GetCurrentThread(), mask) == 0) {
+		printf("ERROR: Could not pin the thread to CPU %d.\n", cpu);
+		exit(1);
+	}
+#elif defined(__linux)
+	if (!startingAffinitySaved) {
+		sched_getaffinity(0, sizeof(startingAffinity), &startingAffinity);
+		startingAffinitySaved = 1;
+	}
+	cpu_set_t set = startingAffinity;
+	if (cpu >= 0) {
+		CPU_ZERO(&set);
+		CPU_SET(cpu, &set);
+	}
+	if (sched_setaffinity(0, sizeof(set), &set) != 0) {
+		printf("ERROR: Could not pin the thread to CPU %d.\n", cpu);
+		exit(1);
+	}
+#endif
+}
+
+// Write to every page of the order pool so that the operating system maps them now rather than in the middle of trading.
+void prefaultMemory() {
+	while (poolCommitted < poolSize) {
+		commitPool();
+	}
+	volatile char* bytes = (volatile char*)limitOrderPool;
+	u64 size = (u64)poolSize * sizeof(limitOrder);
+	for (u64 i = 0; i < size; i += 4096) {
+		bytes[i] = 0;
+	}
+}
+
+// Keep the process's memory resident so that it is never paged out.
+void lockProcessMemory() {
+#if defined(_WIN32)
+	// Windows can only lock what fits in the working set, so grow it to hold the pool first.
+	SIZE_T poolBytes = (SIZE_T)poolSize * sizeof(limitOrder);
+	SIZE_T freeListBytes = (SIZE_T)poolSize * sizeof(limitOrder*);
+	SetProcessWorkingSetSize(GetCurrentProcess(), poolBytes + freeListBytes + ((SIZE_T)64 << 20), poolBytes + freeListBytes + ((SIZE_T)128 << 20));
+	while (poolCommitted < poolSize) {
+		commitPool();
+	}
+	if (!VirtualLock(limitOrderPool, poolBytes) || !VirtualLock(freeLimitOrders, freeListBytes)) {
+		printf("ERROR: Could not lock the order pool into memory.\n");
+		exit(1);
+	}
+#elif defined(__linux)
+	if (mlockall(MCL_CURRENT | MCL_FUTURE) != 0) {
+		printf("ERROR: Could not lock memory. The locked memory limit (ulimit -l) may be too low.\n");
+		exit(1);
+	}
+#endif
+}
+
+void setup() {
+	// Reserve room for poolSize limit orders. They are committed as they are first used.
+	poolPagesMode = hugePages;
+	limitOrderPool = (limitOrder*)allocateMemory((u64)poolSize * sizeof(limitOrder), &poolPagesMode, 1);
+	int mode = HUGE_PAGES_NONE;
+	freeLimitOrders = (limitOrder**)allocateMemory((u64)poolSize * sizeof(limitOrder*), &mode, 1);
+	mode = HUGE_PAGES_NONE;
+	poolBitmap = (u64*)allocateMemory(((u64)poolSize + 63) / 64 * sizeof(u64), &mode, 1);
+	for (int b = 0; b < 3; b++) {
+		mode = HUGE_PAGES_NONE;
+		limboOrders[b] = (limitOrder**)allocateMemory((u64)poolSize * sizeof(limitOrder*), &mode, 1);
+	}
+	mode = hugePages;
+	limitOrderHead = (limitOrder**)allocateMemory(NUM_PRICES * sizeof(limitOrder*), &mode, 0);
+	userLimitOrders = (limitOrder**)calloc(MAX_NUM_USER_LIMIT_ORDERS, sizeof(limitOrder*));
+	resetBook();
+	resetIngress();
+	if (prefaultPool) {
+		prefaultMemory();
+	}
+	if (lockMemory) {
+		lockProcessMemory();
+	}
+
+	for (int i = 0; i < NUM_QUANTITIES; i++) {
+		if (histogramPaths[i] != NULL) {
+			loadHistogram(&quantityTables[i], histogramPaths[i]);
+		}
+	}
+
+	sessionSeed = seed != 0 ? seed : getTime();
+	setSeed(sessionSeed);
+}
+
+// Map a whole file into memory read-only. Return NULL if it could not be opened.
+const unsigned char* mapFile(const char* path, u64* size) {
+	void* data = NULL;
+#if defined(_WIN32)
+	HANDLE file = CreateFileA(path, GENERIC_READ, FILE_SHARE_READ, NULL, OPEN_EXISTING, FILE_ATTRIBUTE_NORMAL, NULL);
+	if (file == INVALID_HANDLE_VALUE) return NULL;
+	LARGE_INTEGER fileSize;
+	GetFileSizeEx(file, &fileSize);
+	*size = fileSize.QuadPart;
+	HANDLE mapping = *size > 0 ? CreateFileMappingA(file, NULL, PAGE_READONLY, 0, 0, NULL) : NULL;
+	CloseHandle(file);
+	if (mapping == NULL) return NULL;
+	data = MapViewOfFile(mapping, FILE_MAP_READ, 0, 0, 0);
+	CloseHandle(mapping);
+#endif
+#ifdef __linux
+	int fd = open(path, O_RDONLY);
+	if (fd < 0) return NULL;
+	struct stat st;
+	fstat(fd, &st);
+	*size = st.st_size;
+	data = *size > 0 ? mmap(NULL, *size, PROT_READ, MAP_PRIVATE, fd, 0) : MAP_FAILED;
+	close(fd);
+	if (data == MAP_FAILED) return NULL;
+	madvise(data, *size, MADV_SEQUENTIAL);
+#endif
+	return (const unsigned char*)data;
+}
+
+void unmapFile(const unsigned char* data, u64 size) {
+#if defined(_WIN32)
+	UnmapViewOfFile(data);
+#endif
+#ifdef __linux
+	munmap((void*)data, size);
+#endif
+}
+
+// Replay a journal's participant orders into an empty book, with the strategy trading against them, under the settings it was
+// recorded with. The settings in use are put back afterwards.
+// Without a strategy, the book is checked against the journal's fingerprints. The replay stops at the first one that differs,
+// and the number of orders replayed before it is returned. Otherwise it returns ULLONG_MAX.
+u64 replayJournalRecords(const journalHeader* h, const journalRecord* records, u64 n);
+
+u64 replayJournal(const journalHeader* h, const journalRecord* records, u64 n) {
+	journalSettings current;
+	saveJournalSettings(&current);
+	loadJournalSettings(&h->settings);
+	u64 diverged = replayJournalRecords(h, records, n);
+	loadJournalSettings(&current);
+	return diverged;
+}
+
+u64 replayJournalRecords(const journalHeader* h, const journalRecord* records, u64 n) {
+	resetBook();
+	setSeed(h->seed);
+	setupMarket(h->startingTime);
+	startSession(h->startingTime);
+
+	u64 targetTime = h->startingTime;
+	for (u64 i = 0; i < n; i++) {
+		u64 t = records[i].t;
+		if (records[i].type == JOURNAL_CHECKPOINT) {
+			// The strategy's orders were not in the recorded session, so the books can only be compared without one.
+			if (!strategyLoaded && records[i].lifespan != bookHash) {
+				return numEvents;
+			}
+			continue;
+		}
+
+		// Frames happen between orders exactly as they did in the recorded session.
+		while (targetTime <= t) {
+			updateFrame(targetTime);
+			if (strategyLoaded) {
+				runStrategy(targetTime);
+			}
+			targetTime += h->frameLengthNS;
+		}
+
+		if (!beginEvent(t)) break;
+
+		orderMessage m;
+		m.user = 0;
+		m.type = records[i].type;
+		m.size = records[i].size;
+		m.distance = records[i].distance;
+		m.crossDistance = records[i].crossDistance;
+		m.lifespan = records[i].lifespan;
+		sendMessage(&m, t);
+		numEvents++;
+
+		if (strategyLoaded) {
+			runStrategy(t);
+		}
+	}
+	updateFrame(targetTime);
+	return ULLONG_MAX;
+}
+
+// Results of backtesting the strategy over one journal.
+typedef struct {
+	bool ok;
+	u64 events;
+	double pnl; // Cents, marking the final position to the midpoint.
+	u64 sharesSent;
+	u64 sharesTraded;
+	long long slippage; // Cents.
+	u64 marketSharesTraded; // Shares in the market orders slippage was measured over.
+} backtestResult;
+
+// Backtest the strategy over the journal at path.
+backtestResult backtestJournal(const char* path) {
+	backtestResult r;
+	memset(&r, 0, sizeof(r));
+
+	u64 size = 0;
+	const unsigned char* data = mapFile(path, &size);
+	if (data == NULL) return r;
+	const journalHeader* h = (const journalHeader*)data;
+	if (size < sizeof(journalHeader) || h->magic != JOURNAL_MAGIC) {
+		unmapFile(data, size);
+		return r;
+	}
+
+	u64 diverged = replayJournal(h, (const journalRecord*)(data + sizeof(journalHeader)), (size - sizeof(journalHeader)) / sizeof(journalRecord));
+	unmapFile(data, size);
+	r.events = numEvents;
+
+	// A replay that left the recorded session says nothing about the strategy.
+	r.ok = diverged == ULLONG_MAX;
+	r.pnl = (double)balance + (double)sharesOpen * (double)((bid + ask) / 2);
+	r.sharesSent = userSharesSent;
+	r.sharesTraded = userSharesTraded;
+	r.slippage = userSlippage;
+	r.marketSharesTraded = userMarketSharesTraded;
+	return r;
+}
+
+// Backtest the strategy over every journal listed in backtestListPath and print the results.
+// Each journal is replayed in its own process with its own book, with at most backtestWorkers running at once.
+void runBacktests() {
+	FILE* list = fopen(backtestListPath, "r");
+	if (list == NULL) {
+		printf("ERROR: Could not open backtest list %s.\n", backtestListPath);
+		exit(1);
+	}
+	int n = 0, capacity = 16;
+	char** paths = (char**)malloc(capacity * sizeof(char*));
+	char line[4096];
+	while (fgets(line, sizeof(line), list) != NULL) {
+		line[strcspn(line, "\r\n")] = 0;
+		if (line[0] == 0) continue;
+		if (n == capacity) {
+			capacity *= 2;
+			paths = (char**)realloc(paths, capacity * sizeof(char*));
+		}
+		paths[n++] = strdup(line);
+	}
+	fclose(list);
+
+	backtestResult* results = (backtestResult*)calloc(n > 0 ? n : 1, sizeof(backtestResult));
+
+#ifdef __linux
+	int workers = backtestWorkers > 0 ? backtestWorkers : (int)sysconf(_SC_NPROCESSORS_ONLN);
+	pid_t* pids = (pid_t*)calloc(n > 0 ? n : 1, sizeof(pid_t));
+	int* pipes = (int*)calloc(n > 0 ? n : 1, sizeof(int));
+	int* slots = (int*)calloc(n > 0 ? n : 1, sizeof(int)); // Which of the workers' CPUs each journal's worker runs on.
+	bool* slotBusy = (bool*)calloc(workers, sizeof(bool));
+	int next = 0, running = 0;
+	fflush(stdout);
+	while (next < n || running > 0) {
+		while (running < workers && next < n) {
+			int fd[2];
+			if (pipe(fd) != 0) {
+				printf("ERROR: Could not create a pipe for a backtest worker.\n");
+				exit(1);
+			}
+			int slot = 0;
+			while (slotBusy[slot]) slot++;
+			slotBusy[slot] = 1;
+			pid_t pid = fork();
+			if (pid == 0) {
+				close(fd[0]);
+				if (workerFirstCPU >= 0) {
+					pinThread(workerFirstCPU + slot);
+				}
+				backtestResult r = backtestJournal(paths[next]);
+				write(fd[1], &r, sizeof(r));
+				_exit(0);
+			}
+			close(fd[1]);
+			pids[next] = pid;
+			pipes[next] = fd[0];
+			slots[next] = slot;
+			next++;
+			running++;
+		}
+
+		// Collect whichever worker finishes first. A worker that died leaves its result marked as failed.
+		pid_t pid = wait(NULL);
+		for (int i = 0; i < next; i++) {
+			if (pids[i] == pid) {
+				if (read(pipes[i], &results[i], sizeof(backtestResult)) != sizeof(backtestResult)) {
+					results[i].ok = 0;
+				}
+				close(pipes[i]);
+				slotBusy[slots[i]] = 0;
+				running--;
+				break;
+			}
+		}
+	}
+	free(pids);
+	free(pipes);
+	free(slots);
+	free(slotBusy);
+#else
+	for (int i = 0; i < n; i++) {
+		results[i] = backtestJournal(paths[i]);
+	}
+#endif
+
+	printf("%-40s %12s %14s %10s %14s\n", "Journal", "Events", "PnL", "Fill rate", "Slippage/sh");
+	double totalPnl = 0;
+	u64 totalSent = 0, totalTraded = 0, totalMarketTraded = 0;
+	long long totalSlippage = 0;
+	int ok = 0;
+	for (int i = 0; i < n; i++) {
+		backtestResult* r = &results[i];
+		if (!r->ok) {
+			printf("%-40s FAILED\n", paths[i]);
+			continue;
+		}
+		ok++;
+		totalPnl += r->pnl;
+		totalSent += r->sharesSent;
+		totalTraded += r->sharesTraded;
+		totalSlippage += r->slippage;
+		totalMarketTraded += r->marketSharesTraded;
+		printf("%-40s %12llu %14.2f %9.1f%% %14.4f\n", paths[i], r->events, r->pnl / 100.0,
+			r->sharesSent ? 100.0 * r->sharesTraded / r->sharesSent : 0.0, r->marketSharesTraded ? r->slippage / 100.0 / r->marketSharesTraded : 0.0);
+	}
+	printf("\n%i of %i journals replayed. Total PnL %.2f, mean %.2f, fill rate %.1f%%, slippage %.4f per market order share.\n", ok, n,
+		totalPnl / 100.0, ok ? totalPnl / 100.0 / ok : 0.0, totalSent ? 100.0 * totalTraded / totalSent : 0.0,
+		totalMarketTraded ? totalSlippage / 100.0 / totalMarketTraded : 0.0);
+
+	for (int i = 0; i < n; i++) {
+		free(paths[i]);
+	}
+	free(paths);
+	free(results);
+}
+
+// Map the journal at path, exiting if it cannot be read. *n is set to the number of records after the header.
+const journalHeader* loadJournal(const char* path, u64* size, u64* n) {
+	const unsigned char* data = mapFile(path, size);
+	if (data == NULL || *size < sizeof(journalHeader) || ((const journalHeader*)data)->magic != JOURNAL_MAGIC) {
+		printf("ERROR: Could not read journal %s.\n", path);
+		exit(1);
+	}
+	*n = (*size - sizeof(journalHeader)) / sizeof(journalRecord);
+	return (const journalHeader*)data;
+}
+
+// Replay the journal at verifyJournalPath and check the book against each of its fingerprints.
+// Returns whether there was at least one fingerprint and they all matched.
+bool verifyJournal() {
+	if (strategyLoaded) {
+		printf("ERROR: A journal can only be verified without a strategy plugin.\n");
+		exit(1);
+	}
+	u64 size, n;
+	const journalHeader* h = loadJournal(verifyJournalPath, &size, &n);
+	const journalRecord* records = (const journalRecord*)(h + 1);
+	u64 diverged = replayJournal(h, records, n);
+
+	// Find the fingerprints on either side of the one that differed.
+	u64 orders = 0, checkpoints = 0, lastMatch = 0;
+	for (u64 i = 0; i < n; i++) {
+		if (records[i].type != JOURNAL_CHECKPOINT) {
+			orders++;
+		}
+		else if (orders < diverged) {
+			checkpoints++;
+			lastMatch = orders;
+		}
+		else if (orders == diverged) {
+			break;
+		}
+	}
+	unmapFile((const unsigned char*)h, size);
+
+	if (diverged != ULLONG_MAX) {
+		printf("%s: the book first differs from the recorded one between orders %llu and %llu (%llu fingerprints matched before).\n",
+			verifyJournalPath, lastMatch, diverged, checkpoints);
+		return 0;
+	}
+	if (checkpoints == 0) {
+		printf("%s: %llu orders replayed, but the journal has no fingerprints, so nothing was verified. Record it with journalHashInterval set.\n",
+			verifyJournalPath, orders);
+		return 0;
+	}
+	printf("%s: %llu orders replayed, all %llu fingerprints match.\n", verifyJournalPath, orders, checkpoints);
+	return 1;
+}
+
+// Compare the journals at compareJournalPaths order by order, and report the first order or fingerprint that differs.
+// Fingerprints are compared wherever both journals have one after the same order.
+void compareJournals() {
+	u64 size[2], n[2];
+	const journalHeader* h[2];
+	const journalRecord* records[2];
+	for (int k = 0; k < 2; k++) {
+		h[k] = loadJournal(compareJournalPaths[k], &size[k], &n[k]);
+		records[k] = (const journalRecord*)(h[k] + 1);
+	}
+	if (h[0]->seed != h[1]->seed || h[0]->frameLengthNS != h[1]->frameLengthNS) {
+		printf("The journals start from different sessions (seed or frame length).\n");
+	}
+	if (memcmp(&h[0]->settings, &h[1]->settings, sizeof(journalSettings)) != 0) {
+		printf("The journals were recorded with different latency, auction, risk, compaction or matching settings.\n");
+	}
+
+	u64 i[2] = { 0, 0 };
+	u64 orders = 0, lastMatch = 0, checkpoints = 0;
+	while (1) {
+		u64 hash[2];
+		bool hasHash[2] = { 0, 0 };
+		for (int k = 0; k < 2; k++) {
+			while (i[k] < n[k] && records[k][i[k]].type == JOURNAL_CHECKPOINT) {
+				hash[k] = records[k][i[k]].lifespan;
+				hasHash[k] = 1;
+				i[k]++;
+			}
+		}
+		if (hasHash[0] && hasHash[1]) {
+			if (hash[0] != hash[1]) {
+				printf("The journals send the same orders, but their books first differ between orders %llu and %llu (%llu fingerprints matched before).\n",
+					lastMatch, orders, checkpoints);
+				break;
+			}
+			checkpoints++;
+			lastMatch = orders;
+		}
+
+		if (i[0] == n[0] || i[1] == n[1]) {
+			if (i[0] == n[0] && i[1] == n[1]) {
+				printf("The journals match: %llu orders, %llu fingerprints compared.\n", orders, checkpoints);
+			}
+			else {
+				printf("The journals match for %llu orders, after which %s ends.\n", orders, compareJournalPaths[i[0] == n[0] ? 0 : 1]);
+			}
+			break;
+		}
+		// Sessions start at the wall clock time, so orders are compared by their time since the start.
+		journalRecord r[2];
+		for (int k = 0; k < 2; k++) {
+			r[k] = records[k][i[k]];
+			r[k].t -= h[k]->startingTime;
+		}
+		if (memcmp(&r[0], &r[1], sizeof(journalRecord)) != 0) {
+			printf("The journals first send a different order at order %llu, %.6f and %.6f s into the session (%llu fingerprints matched before).\n",
+				orders + 1, r[0].t / 1e9, r[1].t / 1e9, checkpoints);
+			break;
+		}
+		orders++;
+		i[0]++;
+		i[1]++;
+	}
+
+	for (int k = 0; k < 2; k++) {
+		unmapFile((const unsigned char*)h[k], size[k]);
+	}
+}
+
+// Quantile sketch in the style of KLL: a stack of compactors, where every item at level h stands for 2^h of the values added.
+// When a level fills up, it is sorted and every other item, starting at a random one of the first two, moves up a level. This keeps
+// the sketch at a fixed size however many values go in, and two sketches merge by adding their levels together. Every compaction
+// at level h moves the rank of any value by 2^h up or down with equal chance, or not at all. rankVariance adds up the variance
+// of those moves, which bounds the error of any quantile with high probability.
+#define SKETCH_K 256
+#define SKETCH_LEVELS 24
+typedef struct {
+	double items[SKETCH_LEVELS][SKETCH_K];
+	u32 counts[SKETCH_LEVELS];
+	u64 n; // Values added.
+	double rankVariance;
+	u64 randState; // Its own stream, so that sketching never changes the participants' orders.
+} quantileSketch;
+
+void initSketch(quantileSketch* q, u64 seed) {
+	memset(q->counts, 0, sizeof(q->counts));
+	q->n = 0;
+	q->rankVariance = 0;
+	q->randState = seed;
+}
+
+int compareDouble(const void* a, const void* b) {
+	double x = *(const double*)a, y = *(const double*)b;
+	return x < y ? -1 : x > y;
+}
+
+// Add an item of weight 2^h, compacting level h and the ones above it as they fill up.
+void sketchPush(quantileSketch* q, int h, double x) {
+	q->items[h][q->counts[h]++] = x;
+	while (q->counts[h] == SKETCH_K) {
+		if (h + 1 == SKETCH_LEVELS) {
+			printf("ERROR: Quantile sketch is full.\n");
+			exit(1);
+		}
+		qsort(q->items[h], SKETCH_K, sizeof(double), compareDouble);
+		for (u32 i = nextRandom(&q->randState) & 1; i < SKETCH_K; i += 2) {
+			q->items[h + 1][q->counts[h + 1]++] = q->items[h][i];
+		}
+		q->counts[h] = 0;
+		q->rankVariance += (double)((u64)1 << h) * (double)((u64)1 << h);
+		h++;
+	}
+}
+
+void sketchAdd(quantileSketch* q, double x) {
+	q->n++;
+	sketchPush(q, 0, x);
+}
+
+// Add everything in b to a.
+void mergeSketch(quantileSketch* a, const quantileSketch* b) {
+	a->n += b->n;
+	a->rankVariance += b->rankVariance;
+	for (int h = 0; h < SKETCH_LEVELS; h++) {
+		for (u32 i = 0; i < b->counts[h]; i++) {
+			sketchPush(a, h, b->items[h][i]);
+		}
+	}
+}
+
+typedef struct {
+	double value;
+	u64 weight;
+} weightedValue;
+
+int compareWeightedValue(const void* a, const void* b) {
+	return compareDouble(&((const weightedValue*)a)->value, &((const weightedValue*)b)->value);
+}
+
+// The rank error, as a fraction of the values added, that the sketch's quantiles are within 99% of the time.
+double sketchRankError(const quantileSketch* q) {
+	return q->n > 0 ? 2.576 * sqrt(q->rankVariance) / q->n : 0;
+}
+
+// Estimate each of the numQuantiles quantiles in fractions, from 0 to 1, into values.
+void sketchQuantiles(const quantileSketch* q, const double* fractions, double* values, int numQuantiles) {
+	weightedValue all[SKETCH_LEVELS * SKETCH_K];
+	u32 n = 0;
+	for (int h = 0; h < SKETCH_LEVELS; h++) {
+		for (u32 i = 0; i < q->counts[h]; i++) {
+			all[n].value = q->items[h][i];
+			all[n].weight = (u64)1 << h;
+			n++;
+		}
+	}
+	qsort(all, n, sizeof(weightedValue), compareWeightedValue);
+	u64 total = 0;
+	for (u32 i = 0; i < n; i++) {
+		total += all[i].weight;
+	}
+	for (int k = 0; k < numQuantiles; k++) {
+		u64 target = (u64)(fractions[k] * total);
+		u64 rank = 0;
+		u32 i = 0;
+		while (i + 1 < n && rank + all[i].weight <= target) {
+			rank += all[i].weight;
+			i++;
+		}
+		values[k] = n > 0 ? all[i].value : 0;
+	}
+}
+
+// Monte Carlo runs: many headless sessions over a range of seeds at each of a list of parameter points.
+// A coordinator hands chunks of seeds to worker processes over Unix domain sockets and collects one small record per session.
+// A worker that dies, for instance because the book emptied, is replaced and the rest of its chunk handed out again.
+
+// The parameters a point can set. Any it doesn't mention keep the value they have in this file.
+typedef struct {
+	const char* name;
+	double* value;
+} monteCarloParameter;
+monteCarloParameter monteCarloParameters[] = {
+	{ "averageOrderCreationDeltaNS", &averageOrderCreationDeltaNS },
+	{ "averageMarketOrderSize", &averageMarketOrderSize },
+	{ "averageLimitOrderSize", &averageLimitOrderSize },
+	{ "averageLimitOrderLifespanNS", &averageLimitOrderLifespanNS },
+	{ "averageLimitOrderDistance", &averageLimitOrderDistance },
+	{ "marketOrderProbability", &marketOrderProbability },
+};
+#define NUM_MONTE_CARLO_PARAMETERS (int)(sizeof(monteCarloParameters) / sizeof(monteCarloParameter))
+
+typedef struct {
+	double values[NUM_MONTE_CARLO_PARAMETERS];
+	char* text;
+} monteCarloPoint;
+
+// The outcome of one session.
+typedef struct {
+	double mid; // Final midpoint in cents.
+	u32 spread;
+	u32 depth; // Shares within 10 cents of each side of the touch.
+	double pnl; // The user's PnL in cents, marking the final position to the midpoint.
+} monteCarloResult;
+
+// The outcomes kept for every point, each in its own quantile sketch.
+enum { METRIC_MID, METRIC_SPREAD, METRIC_DEPTH, METRIC_PNL, NUM_MONTE_CARLO_METRICS };
+char* monteCarloMetricText[NUM_MONTE_CARLO_METRICS] = { "Mid ($)", "Spread ($)", "Depth (shares)", "User PnL ($)" };
+
+typedef struct {
+	u64 ok, failed;
+	quantileSketch sketches[NUM_MONTE_CARLO_METRICS];
+} monteCarloOutcome;
+
+void initOutcome(monteCarloOutcome* o, u64 seed) {
+	o->ok = 0;
+	o->failed = 0;
+	for (int m = 0; m < NUM_MONTE_CARLO_METRICS; m++) {
+		initSketch(&o->sketches[m], seed + m);
+	}
+}
+
+void addResult(monteCarloOutcome* o, const monteCarloResult* r) {
+	o->ok++;
+	sketchAdd(&o->sketches[METRIC_MID], r->mid / 100);
+	sketchAdd(&o->sketches[METRIC_SPREAD], r->spread / 100.0);
+	sketchAdd(&o->sketches[METRIC_DEPTH], r->depth);
+	sketchAdd(&o->sketches[METRIC_PNL], r->pnl / 100);
+}
+
+void mergeOutcome(monteCarloOutcome* a, const monteCarloOutcome* b) {
+	a->ok += b->ok;
+	a->failed += b->failed;
+	for (int m = 0; m < NUM_MONTE_CARLO_METRICS; m++) {
+		mergeSketch(&a->sketches[m], &b->sketches[m]);
+	}
+}
+
+// A range of seeds to run at one point.
+typedef struct {
+	u32 point;
+	u32 count;
+	u64 firstSeed;
+	int attempts; // Times the first seed has already crashed a worker.
+} monteCarloJob;
+
+monteCarloPoint* monteCarloPoints = NULL;
+int numMonteCarloPoints = 0;
+
+// Load the parameter points from monteCarloPointsPath. Each line sets parameters by name, such as
+// "marketOrderProbability 0.45 averageLimitOrderDistance 4". Empty lines and lines starting with # are ignored.
+void loadMonteCarloPoints() {
+	int capacity = 16;
+	monteCarloPoints = (monteCarloPoint*)malloc(capacity * sizeof(monteCarloPoint));
+	double defaults[NUM_MONTE_CARLO_PARAMETERS];
+	for (int i = 0; i < NUM_MONTE_CARLO_PARAMETERS; i++) {
+		defaults[i] = *monteCarloParameters[i].value;
+	}
+	if (monteCarloPointsPath == NULL) {
+		memcpy(monteCarloPoints[0].values, defaults, sizeof(defaults));
+		monteCarloPoints[0].text = strdup("defaults");
+		numMonteCarloPoints = 1;
+		return;
+	}
+
+	FILE* f = fopen(monteCarloPointsPath, "r");
+	if (f == NULL) {
+		printf("ERROR: Could not open parameter points %s.\n", monteCarloPointsPath);
+		exit(1);
+	}
+	char line[1024];
+	for (int lineNumber = 1; fgets(line, sizeof(line), f) != NULL; lineNumber++) {
+		line[strcspn(line, "\r\n")] = 0;
+		if (line[0] == '#' || strspn(line, " \t") == strlen(line)) continue;
+		if (numMonteCarloPoints == capacity) {
+			capacity *= 2;
+			monteCarloPoints = (monteCarloPoint*)realloc(monteCarloPoints, capacity * sizeof(monteCarloPoint));
+		}
+		monteCarloPoint* point = &monteCarloPoints[numMonteCarloPoints++];
+		memcpy(point->values, defaults, sizeof(defaults));
+		point->text = strdup(line);
+
+		char* name = strtok(line, " \t");
+		while (name != NULL) {
+			char* value = strtok(NULL, " \t");
+			int k = 0;
+			while (k < NUM_MONTE_CARLO_PARAMETERS && strcmp(name, monteCarloParameters[k].name) != 0) k++;
+			if (k == NUM_MONTE_CARLO_PARAMETERS || value == NULL) {
+				printf("ERROR: Line %d of %s should hold parameter names each followed by a value.\n", lineNumber, monteCarloPointsPath);
+				exit(1);
+			}
+			point->values[k] = atof(value);
+			name = strtok(NULL, " \t");
+		}
+	}
+	fclose(f);
+}
+
+// Run one headless session of headlessDurationNS from the given seed with the parameters of point.
+monteCarloResult runMonteCarloSession(u32 point, u64 sessionSeed) {
+	for (int i = 0; i < NUM_MONTE_CARLO_PARAMETERS; i++) {
+		*monteCarloParameters[i].value = monteCarloPoints[point].values[i];
+	}
+	resetBook();
+	setSeed(sessionSeed);
+	u64 start = 1000000000000ULL;
+	setupMarket(start);
+	startSession(start);
+	if (pipelineGeneration) {
+		startGeneratorThread(start);
+	}
+
+	u64 next = start, frame = start;
+	while (frame - start < headlessDurationNS) {
+		if (next < frame) {
+			participantEvent(&next);
+		}
+		else {
+			updateFrame(frame);
+			if (strategyLoaded) {
+				runStrategy(frame);
+			}
+			compactStep(frame);
+			frame += frameLengthNS;
+		}
+	}
+	if (pipelineGeneration) {
+		stopGeneratorThread();
+	}
+
+	monteCarloResult r;
+	memset(&r, 0, sizeof(r));
+	r.mid = ((double)bid + (double)ask) / 2;
+	r.spread = ask - bid;
+	for (u32 p = bid >= 10 ? bid - 10 : 0; p <= bid; p++) {
+		r.depth += levelVolume[p];
+	}
+	for (u32 p = ask; p <= ask + 10 && p < NUM_PRICES; p++) {
+		r.depth += levelVolume[p];
+	}
+	r.pnl = (double)balance + (double)sharesOpen * r.mid;
+	return r;
+}
+
+#ifdef __linux
+typedef struct {
+	pid_t pid;
+	int fd;
+	bool busy;
+	monteCarloJob job;
+	u32 received; // Sessions of the job finished so far.
+} monteCarloWorker;
+
+// What a worker sends back: one of these after each session, then the outcome of the whole job.
+enum { WORKER_SESSION_DONE, WORKER_JOB_DONE };
+typedef struct {
+	int type;
+} monteCarloWorkerMessage;
+
+// Read exactly size bytes. Return 0 if the other end closed or failed first.
+bool readFully(int fd, void* data, u64 size) {
+	unsigned char* d = (unsigned char*)data;
+	while (size > 0) {
+		ssize_t n = read(fd, d, size);
+		if (n <= 0) return 0;
+		d += n;
+		size -= n;
+	}
+	return 1;
+}
+
+bool writeFully(int fd, const void* data, u64 size) {
+	const unsigned char* d = (const unsigned char*)data;
+	while (size > 0) {
+		ssize_t n = write(fd, d, size);
+		if (n <= 0) return 0;
+		d += n;
+		size -= n;
+	}
+	return 1;
+}
+
+// Run jobs sent by the coordinator until it closes the socket. The outcome of each job is sketched here and sent when it is done.
+void monteCarloWorkerLoop(int fd) {
+	monteCarloJob job;
+	monteCarloOutcome* outcome = (monteCarloOutcome*)malloc(sizeof(monteCarloOutcome));
+	while (readFully(fd, &job, sizeof(job))) {
+		initOutcome(outcome, job.firstSeed);
+		monteCarloWorkerMessage m;
+		for (u32 i = 0; i < job.count; i++) {
+			monteCarloResult r = runMonteCarloSession(job.point, job.firstSeed + i);
+			addResult(outcome, &r);
+			m.type = WORKER_SESSION_DONE;
+			if (!writeFully(fd, &m, sizeof(m))) _exit(1);
+		}
+		m.type = WORKER_JOB_DONE;
+		if (!writeFully(fd, &m, sizeof(m)) || !writeFully(fd, outcome, sizeof(monteCarloOutcome))) _exit(1);
+	}
+	_exit(0);
+}
+
+// Start worker i in its own process, connected to the coordinator by a socket pair.
+void startMonteCarloWorker(monteCarloWorker* workers, int i) {
+	int fd[2];
+	if (socketpair(AF_UNIX, SOCK_STREAM, 0, fd) != 0) {
+		printf("ERROR: Could not create a socket for a Monte Carlo worker.\n");
+		exit(1);
+	}
+	fflush(stdout);
+	pid_t pid = fork();
+	if (pid < 0) {
+		printf("ERROR: Could not start a Monte Carlo worker.\n");
+		exit(1);
+	}
+	if (pid == 0) {
+		close(fd[0]);
+		for (int k = 0; k < i; k++) {
+			close(workers[k].fd);
+		}
+		if (workerFirstCPU >= 0) {
+			pinThread(workerFirstCPU + i);
+		}
+		monteCarloWorkerLoop(fd[1]);
+	}
+	close(fd[1]);
+	workers[i].pid = pid;
+	workers[i].fd = fd[0];
+	workers[i].busy = 0;
+}
+
+void queueJob(monteCarloJob** jobs, u64* numJobs, u64* capacity, monteCarloJob job) {
+	if (*numJobs == *capacity) {
+		*capacity *= 2;
+		*jobs = (monteCarloJob*)realloc(*jobs, *capacity * sizeof(monteCarloJob));
+	}
+	(*jobs)[(*numJobs)++] = job;
+}
+#endif
+
+// Run monteCarloSeeds sessions at every parameter point and print the distribution of each outcome at each point.
+// Each worker sketches the outcomes of a job, and the coordinator merges the sketches, so no session's results are kept.
+void runMonteCarlo() {
+	loadMonteCarloPoints();
+	u64 total = (u64)numMonteCarloPoints * monteCarloSeeds;
+	monteCarloOutcome* outcomes = (monteCarloOutcome*)malloc(numMonteCarloPoints * sizeof(monteCarloOutcome));
+	for (int point = 0; point < numMonteCarloPoints; point++) {
+		initOutcome(&outcomes[point], point * NUM_MONTE_CARLO_METRICS + 1);
+	}
+	u64 t0 = getTime();
+
+	// Split every point's seeds into jobs.
+	u64 numJobs = 0, capacity = total / monteCarloChunk + numMonteCarloPoints + 16;
+	monteCarloJob* jobs = (monteCarloJob*)malloc(capacity * sizeof(monteCarloJob));
+	for (int point = 0; point < numMonteCarloPoints; point++) {
+		for (u32 i = 0; i < monteCarloSeeds; i += monteCarloChunk) {
+			monteCarloJob* j = &jobs[numJobs++];
+			j->point = point;
+			j->firstSeed = monteCarloFirstSeed + i;
+			j->count = monteCarloSeeds - i < monteCarloChunk ? monteCarloSeeds - i : monteCarloChunk;
+			j->attempts = 0;
+		}
+	}
+	u64 crashes = 0;
+
+#ifdef __linux
+	int numWorkers = monteCarloWorkers > 0 ? monteCarloWorkers : (int)sysconf(_SC_NPROCESSORS_ONLN);
+	monteCarloWorker* workers = (monteCarloWorker*)calloc(numWorkers, sizeof(monteCarloWorker));
+	struct pollfd* polls = (struct pollfd*)calloc(numWorkers, sizeof(struct pollfd));
+	monteCarloOutcome* received = (monteCarloOutcome*)malloc(sizeof(monteCarloOutcome));
+	for (int i = 0; i < numWorkers; i++) {
+		startMonteCarloWorker(workers, i);
+	}
+
+	u64 nextJob = 0, done = 0;
+	while (done < total) {
+		// Hand a job to every idle worker.
+		for (int i = 0; i < numWorkers && nextJob < numJobs; i++) {
+			if (workers[i].busy) continue;
+			workers[i].job = jobs[nextJob++];
+			workers[i].received = 0;
+			workers[i].busy = 1;
+			send(workers[i].fd, &workers[i].job, sizeof(monteCarloJob), MSG_NOSIGNAL);
+		}
+
+		for (int i = 0; i < numWorkers; i++) {
+			polls[i].fd = workers[i].busy ? workers[i].fd : -1;
+			polls[i].events = POLLIN;
+			polls[i].revents = 0;
+		}
+		poll(polls, numWorkers, -1);
+
+		for (int i = 0; i < numWorkers; i++) {
+			if (polls[i].revents == 0) continue;
+			monteCarloWorker* w = &workers[i];
+			monteCarloWorkerMessage m;
+			if (readFully(w->fd, &m, sizeof(m))) {
+				if (m.type == WORKER_SESSION_DONE) {
+					w->received++;
+					continue;
+				}
+				if (readFully(w->fd, received, sizeof(monteCarloOutcome))) {
+					mergeOutcome(&outcomes[w->job.point], received);
+					done += w->job.count;
+					w->busy = 0;
+					continue;
+				}
+			}
+
+			// The worker died during the session after the last one it finished, and the job's sketches died with it.
+			// Run the sessions it finished again, run the one it died in again or give up on it after monteCarloRetries,
+			// and hand out the rest of the job again.
+			waitpid(w->pid, NULL, 0);
+			close(w->fd);
+			crashes++;
+			monteCarloJob j = w->job;
+			if (w->received > 0) {
+				monteCarloJob before = { j.point, w->received, j.firstSeed, 0 };
+				queueJob(&jobs, &numJobs, &capacity, before);
+			}
+			if (w->received < j.count) {
+				monteCarloJob crashed = { j.point, 1, j.firstSeed + w->received, (w->received == 0 ? j.attempts : 0) + 1 };
+				if (crashed.attempts > monteCarloRetries) {
+					outcomes[j.point].failed++;
+					done++;
+				}
+				else {
+					queueJob(&jobs, &numJobs, &capacity, crashed);
+				}
+				if (w->received + 1 < j.count) {
+					monteCarloJob after = { j.point, j.count - w->received - 1, crashed.firstSeed + 1, 0 };
+					queueJob(&jobs, &numJobs, &capacity, after);
+				}
+			}
+			startMonteCarloWorker(workers, i);
+		}
+	}
+
+	// Closing the sockets tells the workers to finish.
+	for (int i = 0; i < numWorkers; i++) {
+		close(workers[i].fd);
+	}
+	for (int i = 0; i < numWorkers; i++) {
+		waitpid(workers[i].pid, NULL, 0);
+	}
+	free(workers);
+	free(polls);
+	free(received);
+#else
+	// Without fork, run every session in this process. A session that crashes ends the run.
+	for (u64 k = 0; k < numJobs; k++) {
+		for (u32 i = 0; i < jobs[k].count; i++) {
+			monteCarloResult r = runMonteCarloSession(jobs[k].point, jobs[k].firstSeed + i);
+			addResult(&outcomes[jobs[k].point], &r);
+		}
+	}
+#endif
+	u64 t1 = getTime();
+
+	double fractions[5] = { 0.01, 0.05, 0.5, 0.95, 0.99 };
+	for (int point = 0; point < numMonteCarloPoints; point++) {
+		monteCarloOutcome* o = &outcomes[point];
+		printf("%s: %llu sessions, %llu failed\n", monteCarloPoints[point].text, o->ok, o->failed);
+		printf("  %-16s %10s %10s %10s %10s %10s %12s\n", "", "p1", "p5", "p50", "p95", "p99", "Rank error");
+		for (int m = 0; m < NUM_MONTE_CARLO_METRICS; m++) {
+			double q[5];
+			sketchQuantiles(&o->sketches[m], fractions, q, 5);
+			printf("  %-16s %10.2f %10.2f %10.2f %10.2f %10.2f %11.2f%%\n", monteCarloMetricText[m], q[0], q[1], q[2], q[3], q[4],
+				100 * sketchRankError(&o->sketches[m]));
+		}
+	}
+	printf("\n%llu sessions in %.2f s, %llu worker crashes.\n", total, (double)(t1 - t0) / 1e9, crashes);
+	free(jobs);
+	free(outcomes);
+}
+
+// Reference book for checking the matching core. Each price keeps its orders in a plain array in the order they fill, and everything
+// is done the obvious way, without the free lists, running totals and shortcuts of the real book. runDifferential sends the same
+// events to both books and compares them after every one, so that changes to the real book can be checked against it.
+typedef struct {
+	u32 id;
+	u32 size;
+	u64 expirationTime;
+	bool user;
+} referenceOrder;
+
+typedef struct {
+	referenceOrder* orders;
+	u32 count;
+	u32 capacity;
+} referenceLevel;
+
+referenceLevel referenceLevels[NUM_PRICES];
+u32 referenceBid, referenceAsk;
+int referenceBalance, referenceSharesOpen;
+int referenceUserOrders; // The user's limit orders that have not been filled or cancelled.
+int referenceOpenBuyShares, referenceOpenSellShares;
+u32 referenceNextId;
+u32 referenceUserMin, referenceUserMax; // Prices the user's orders have been placed between since they were last cancelled.
+u32 referenceMin, referenceMax; // Prices every order but the anchors has been placed between.
+u64 referenceHash; // Fingerprint of the reference book, computed from scratch for every level that changed.
+u64 referenceLevelHash[NUM_PRICES];
+bool referenceLevelChanged[NUM_PRICES];
+u32 referenceChanged[NUM_PRICES]; // The levels that changed during the current event.
+u32 numReferenceChanged;
+
+// Prices of the orders that keep each side of both books from emptying. They are never traded.
+#define ANCHOR_BUY_PRICE 1
+#define ANCHOR_SELL_PRICE (NUM_PRICES - 2)
+
+void referenceLevelChange(u32 p) {
+	if (!referenceLevelChanged[p]) {
+		referenceLevelChanged[p] = 1;
+		referenceChanged[numReferenceChanged++] = p;
+	}
+}
+
+void resetReferenceBook() {
+	for (u32 p = 0; p < NUM_PRICES; p++) {
+		referenceLevels[p].count = 0;
+		referenceLevelHash[p] = 0;
+		referenceLevelChanged[p] = 0;
+	}
+	numReferenceChanged = 0;
+	referenceHash = 0;
+	referenceBid = 0;
+	referenceAsk = UINT_MAX;
+	referenceBalance = 0;
+	referenceSharesOpen = 0;
+	referenceUserOrders = 0;
+	referenceOpenBuyShares = 0;
+	referenceOpenSellShares = 0;
+	referenceNextId = 0;
+	referenceUserMin = UINT_MAX;
+	referenceUserMax = 0;
+	referenceMin = UINT_MAX;
+	referenceMax = 0;
+}
+
+void referenceInsert(u32 p, u32 i, referenceOrder o) {
+	referenceLevel* l = &referenceLevels[p];
+	if (l->count == l->capacity) {
+		l->capacity = l->capacity > 0 ? 2 * l->capacity : 8;
+		l->orders = (referenceOrder*)realloc(l->orders, l->capacity * sizeof(referenceOrder));
+	}
+	memmove(&l->orders[i + 1], &l->orders[i], (l->count - i) * sizeof(referenceOrder));
+	l->orders[i] = o;
+	l->count++;
+	referenceLevelChange(p);
+}
+
+void referenceRemove(u32 p, u32 i) {
+	referenceLevel* l = &referenceLevels[p];
+	memmove(&l->orders[i], &l->orders[i + 1], (l->count - i - 1) * sizeof(referenceOrder));
+	l->count--;
+	referenceLevelChange(p);
+}
+
+void referenceAdd(u32 p, u32 size, u64 expirationTime, bool user) {
+	referenceOrder o = { ++referenceNextId, size, expirationTime, user };
+	referenceInsert(p, fillTiesInStackOrder ? 0 : referenceLevels[p].count, o);
+	if (p != ANCHOR_BUY_PRICE && p != ANCHOR_SELL_PRICE) {
+		if (p < referenceMin) referenceMin = p;
+		if (p > referenceMax) referenceMax = p;
+	}
+	if (user) {
+		referenceUserOrders++;
+		if (p < referenceUserMin) referenceUserMin = p;
+		if (p > referenceUserMax) referenceUserMax = p;
+	}
+}
+
+// Remove every order at price p that has expired by time t.
+void referenceExpire(u32 p, u64 t) {
+	for (u32 i = 0; i < referenceLevels[p].count;) {
+		if (referenceLevels[p].orders[i].expirationTime <= t) {
+			referenceRemove(p, i);
+		}
+		else {
+			i++;
+		}
+	}
+}
+
+// Fill orders at price p in priority order until size becomes 0 or the level is empty, adding the value traded to o.
+void referenceFill(u32 p, u32* size, u32* o, bool isSell) {
+	referenceLevel* l = &referenceLevels[p];
+	while (*size > 0 && l->count > 0) {
+		referenceOrder* curr = &l->orders[0];
+		u32 s = curr->size < *size ? curr->size : *size;
+		*o += s * p;
+		*size -= s;
+		if (curr->user) {
+			if (isSell) {
+				referenceBalance -= s * p;
+				referenceSharesOpen += s;
+				referenceOpenBuyShares -= s;
+			}
+			else {
+				referenceBalance += s * p;
+				referenceSharesOpen -= s;
+				referenceOpenSellShares -= s;
+			}
+			if (s == curr->size) referenceUserOrders--;
+		}
+		if (s == curr->size) {
+			referenceRemove(p, 0);
+		}
+		else {
+			curr->size -= s;
+			referenceLevelChange(p);
+		}
+	}
+}
+
+// Execute a market order against the reference book, returning the value traded.
+u32 referenceMarket(u32 size, u64 t, bool isSell) {
+	u32 o = 0;
+	for (u32 p = isSell ? referenceBid : referenceAsk; size > 0; p = isSell ? p - 1 : p + 1) {
+		if (referenceLevels[p].count == 0) continue;
+		if (isSell) {
+			referenceBid = p;
+		}
+		else {
+			referenceAsk = p;
+		}
+		referenceExpire(p, t);
+		referenceFill(p, &size, &o, isSell);
+	}
+	return o;
+}
+
+// Shares a market order on the given side could fill at time t from the first levels prices with live orders, within span prices
+// of the touch and short of the anchors. Counting stops once it reaches limit.
+u32 referenceLiveVolume(bool isSell, u64 t, u32 levels, u32 span, u32 limit) {
+	u32 v = 0;
+	for (u32 p = isSell ? referenceBid : referenceAsk; p >= referenceMin && p <= referenceMax && levels > 0 && span > 0 && v < limit;
+		p = isSell ? p - 1 : p + 1, span--) {
+		u32 before = v;
+		for (u32 i = 0; i < referenceLevels[p].count; i++) {
+			if (referenceLevels[p].orders[i].expirationTime > t) v += referenceLevels[p].orders[i].size;
+		}
+		if (v > before) levels--;
+	}
+	return v < limit ? v : limit;
+}
+
+// Bring the whole reference book up to date at the start of a frame.
+void referenceFrame(u64 t) {
+	for (u32 p = 0; p < NUM_PRICES; p++) {
+		referenceExpire(p, t);
+	}
+	while (referenceLevels[referenceBid].count == 0) referenceBid--;
+	while (referenceLevels[referenceAsk].count == 0) referenceAsk++;
+}
+
+// Execute a participant's message against the reference book during continuous trading.
+void referenceParticipantMessage(orderMessage* m, u64 t) {
+	switch (m->type) {
+	case MESSAGE_MARKET_BUY:
+		referenceMarket(m->size, t, 0);
+		break;
+	case MESSAGE_MARKET_SELL:
+		referenceMarket(m->size, t, 1);
+		break;
+	case MESSAGE_LIMIT_SELL: {
+		u32 p = referenceBid + m->distance;
+		referenceAdd(p, m->size, t + m->lifespan, 0);
+		if (p < referenceAsk) referenceAsk = p;
+		break;
+	}
+	case MESSAGE_LIMIT_BUY: {
+		u32 p = referenceAsk - m->distance;
+		referenceAdd(p, m->size, t + m->lifespan, 0);
+		if (p > referenceBid) referenceBid = p;
+		break;
+	}
+	}
+}
+
+// Execute one of the user's messages against the reference book during continuous trading.
+void referenceUserMessage(orderMessage* m, u64 t) {
+	switch (m->type) {
+	case MESSAGE_MARKET_BUY:
+		referenceBalance -= realisticUserMarketOrders ? referenceMarket(m->size, t, 0) : m->size * referenceAsk;
+		referenceSharesOpen += m->size;
+		break;
+	case MESSAGE_MARKET_SELL:
+		referenceBalance += realisticUserMarketOrders ? referenceMarket(m->size, t, 1) : m->size * referenceBid;
+		referenceSharesOpen -= m->size;
+		break;
+	case MESSAGE_LIMIT_BUY: {
+		u32 p = m->price == PRICE_AT_TOUCH ? referenceBid : m->price;
+		if (referenceUserOrders < MAX_NUM_USER_LIMIT_ORDERS && p < referenceAsk) {
+			referenceAdd(p, m->size, ULLONG_MAX, 1);
+			if (p > referenceBid) referenceBid = p;
+			referenceOpenBuyShares += m->size;
+		}
+		break;
+	}
+	case MESSAGE_LIMIT_SELL: {
+		u32 p = m->price == PRICE_AT_TOUCH ? referenceAsk : m->price;
+		if (referenceUserOrders < MAX_NUM_USER_LIMIT_ORDERS && p > referenceBid && p < NUM_PRICES) {
+			referenceAdd(p, m->size, ULLONG_MAX, 1);
+			if (p < referenceAsk) referenceAsk = p;
+			referenceOpenSellShares += m->size;
+		}
+		break;
+	}
+	case MESSAGE_CANCEL_ALL:
+		for (u32 p = referenceUserMin; p <= referenceUserMax; p++) {
+			for (u32 i = 0; i < referenceLevels[p].count; i++) {
+				if (referenceLevels[p].orders[i].user) referenceLevels[p].orders[i].expirationTime = 0;
+			}
+		}
+		referenceUserMin = UINT_MAX;
+		referenceUserMax = 0;
+		referenceUserOrders = 0;
+		referenceOpenBuyShares = 0;
+		referenceOpenSellShares = 0;
+		break;
+	}
+}
+
+// The stream and event being checked, for reporting a difference.
+u64 differentialSeed = 0;
+u64 differentialEvent = 0;
+const char* differentialEventText = "";
+
+void differentialMismatch(const char* what, long long value, long long expected) {
+	printf("ERROR: Seed %llu, event %llu (%s): %s is %lld in the book and %lld in the reference book.\n", differentialSeed, differentialEvent,
+		differentialEventText, what, value, expected);
+	exit(1);
+}
+
+// Compare the book with the reference book after an event. Levels the reference book changed are compared in full, and
+// the fingerprints catch a change the book made anywhere else.
+void checkAgainstReference() {
+	for (u32 k = 0; k < numReferenceChanged; k++) {
+		u32 p = referenceChanged[k];
+		referenceLevelChanged[p] = 0;
+		u64 h = 0;
+		u32 volume = 0, userOrders = 0, prevId = 0;
+		for (u32 i = 0; i < referenceLevels[p].count; i++) {
+			referenceOrder* o = &referenceLevels[p].orders[i];
+			h ^= orderKey(p, o->id, o->size, prevId);
+			volume += o->size;
+			userOrders += o->user;
+			prevId = o->id;
+		}
+		char what[64];
+		snprintf(what, sizeof(what), "At price %u, the number of orders", p);
+		if (levelOrders[p] != referenceLevels[p].count) differentialMismatch(what, levelOrders[p], referenceLevels[p].count);
+		snprintf(what, sizeof(what), "At price %u, the volume", p);
+		if (levelVolume[p] != volume) differentialMismatch(what, levelVolume[p], volume);
+		snprintf(what, sizeof(what), "At price %u, the number of the user's orders", p);
+		if (levelUserOrders[p] != userOrders) differentialMismatch(what, levelUserOrders[p], userOrders);
+		snprintf(what, sizeof(what), "At price %u, the fingerprint of the queue", p);
+		if (levelHash[p] != h) differentialMismatch(what, (long long)levelHash[p], (long long)h);
+		referenceHash ^= referenceLevelHash[p] ^ h;
+		referenceLevelHash[p] = h;
+	}
+	numReferenceChanged = 0;
+
+	if (bookHash != referenceHash) differentialMismatch("The fingerprint", (long long)bookHash, (long long)referenceHash);
+	if (bid != referenceBid) differentialMismatch("The bid", bid, referenceBid);
+	if (ask != referenceAsk) differentialMismatch("The ask", ask, referenceAsk);
+	if (balance != referenceBalance) differentialMismatch("The balance", balance, referenceBalance);
+	if (sharesOpen != referenceSharesOpen) differentialMismatch("The shares open", sharesOpen, referenceSharesOpen);
+	if (numUserLimitOrders != referenceUserOrders) differentialMismatch("The number of the user's orders", numUserLimitOrders, referenceUserOrders);
+	if (userOpenBuyShares != referenceOpenBuyShares) differentialMismatch("The user's open buy shares", userOpenBuyShares, referenceOpenBuyShares);
+	if (userOpenSellShares != referenceOpenSellShares) differentialMismatch("The user's open sell shares", userOpenSellShares, referenceOpenSellShares);
+}
+
+// Draw a quantity that is usually small, sometimes medium and now and then large.
+u32 differentialQuantity(u64* g, u32 small, u32 medium, u32 large) {
+	u64 x = nextRandom(g) % 100;
+	u32 range = x < 70 ? small : x < 95 ? medium : large;
+	return 1 + nextRandom(g) % range;
+}
+
+// Draw the size of a market order on the given side, often exactly what is at the first few prices. It takes from at most 8 prices
+// with orders and never empties a side, so that the price stays put, and 0 means there is nothing near the touch to trade.
+u32 differentialMarketSize(u64* g, bool isSell, u64 t) {
+	u32 size;
+	u64 x = nextRandom(g) % 10;
+	if (x < 3) {
+		// Exactly clear one or more levels, or leave one share, or take one more.
+		size = referenceLiveVolume(isSell, t, 1 + nextRandom(g) % 3, 1000, UINT_MAX);
+		size += nextRandom(g) % 3;
+		size = size > 1 ? size - 1 : 1;
+	}
+	else {
+		size = differentialQuantity(g, 20, 100, 1000);
+	}
+	u32 near = referenceLiveVolume(isSell, t, 8, 1000, UINT_MAX);
+	if (near > 0 && near == referenceLiveVolume(isSell, t, 9, 1000, UINT_MAX)) {
+		near--; // Leave a share, since nothing else is close.
+	}
+	return size < near ? size : near;
+}
+
+// Send differentialEvents random events from one seed to the book and the reference book and check them after each one.
+// The stream mixes the participants' and user's orders, cancels and frames, with prices and expiration times that often tie.
+void runDifferentialStream(u64 streamSeed) {
+	u64 g = streamSeed;
+	nextRandom(&g);
+	differentialSeed = streamSeed;
+
+	// Each stream picks its own settings, so that every path through the matching core is exercised.
+	fillTiesInStackOrder = nextRandom(&g) & 1;
+	realisticUserMarketOrders = nextRandom(&g) % 4 != 0;
+	compactionIntervalNS = nextRandom(&g) % 3 == 0 ? 1000000 : 0;
+	compactionSliceOrders = 1 + nextRandom(&g) % 16;
+	u64 frameOdds = 1000 + nextRandom(&g) % 20000; // One event in this many is a frame.
+	latencyUserNS = 0;
+	latencyParticipantNS = 0;
+	latencyJitterNS = 0;
+	gatewayServiceNS = 0;
+	openingAuctionLengthNS = 0;
+	closingAuctionStartNS = 0;
+
+	resetBook();
+	resetReferenceBook();
+	u64 t = 1000000000;
+	startSession(t);
+	addLimitOrder(ANCHOR_BUY_PRICE, 1, ULLONG_MAX, 0);
+	referenceAdd(ANCHOR_BUY_PRICE, 1, ULLONG_MAX, 0);
+	addLimitOrder(ANCHOR_SELL_PRICE, 1, ULLONG_MAX, 0);
+	referenceAdd(ANCHOR_SELL_PRICE, 1, ULLONG_MAX, 0);
+	bid = referenceBid = ANCHOR_BUY_PRICE;
+	ask = referenceAsk = ANCHOR_SELL_PRICE;
+	for (u32 p = NUM_PRICES / 2 - 10; p < NUM_PRICES / 2 + 10; p++) {
+		u32 size = differentialQuantity(&g, 10, 200, 5000);
+		addLimitOrder(p, size, ULLONG_MAX, 0);
+		referenceAdd(p, size, ULLONG_MAX, 0);
+	}
+	bid = referenceBid = NUM_PRICES / 2 - 1;
+	ask = referenceAsk = NUM_PRICES / 2;
+	checkAgainstReference();
+
+	const char* messageText[5] = { "market buy", "market sell", "limit buy", "limit sell", "cancel" };
+	for (differentialEvent = 1; differentialEvent <= differentialEvents; differentialEvent++) {
+		// Move the clock on, often not at all, so that orders tie on time and expire together.
+		u64 x = nextRandom(&g) % 100;
+		t += x < 25 ? 0 : x < 99 ? nextRandom(&g) % 2000 : nextRandom(&g) % 2000000;
+		beginEvent(t);
+
+		// Lean towards trading the price back to the middle, so that long streams do not wander off to the edges of the book.
+		u64 kind = nextRandom(&g) % 100;
+		bool isSell = nextRandom(&g) % 100 < (bid > NUM_PRICES / 2 ? 60 : 40);
+		if (nextRandom(&g) % frameOdds == 0) {
+			differentialEventText = "frame";
+			updateFrame(t);
+			referenceFrame(t);
+		}
+		else if (kind < 55) {
+			orderMessage m;
+			m.user = 0;
+			m.type = isSell ? MESSAGE_LIMIT_SELL : MESSAGE_LIMIT_BUY;
+			m.size = differentialQuantity(&g, 10, 200, 5000);
+			m.distance = differentialQuantity(&g, 3, 20, 100);
+			m.crossDistance = 0;
+			u64 y = nextRandom(&g) % 10;
+			m.lifespan = y == 0 ? 0 : y < 3 ? 1000 : y < 9 ? 1 + nextRandom(&g) % 10000000 : 1 + nextRandom(&g) % 1000000000;
+			if (isSell ? bid + m.distance >= ANCHOR_SELL_PRICE : ask <= m.distance + ANCHOR_BUY_PRICE) continue;
+			differentialEventText = messageText[m.type];
+			executeMessage(&m, t);
+			referenceParticipantMessage(&m, t);
+		}
+		else if (kind < 70) {
+			u32 size = differentialMarketSize(&g, isSell, t);
+			if (size == 0) continue;
+			differentialEventText = isSell ? "market sell" : "market buy";
+			u32 o = isSell ? marketSell(size, t) : marketBuy(size, t);
+			u32 expected = referenceMarket(size, t, isSell);
+			if (o != expected) differentialMismatch("The value traded", o, expected);
+		}
+		else if (kind < 87) {
+			u32 price = PRICE_AT_TOUCH;
+			if (nextRandom(&g) & 1) {
+				price = (isSell ? ask : bid) + nextRandom(&g) % 7 - 3;
+				if (price <= ANCHOR_BUY_PRICE || price >= ANCHOR_SELL_PRICE) continue;
+			}
+			orderMessage m = userMessage(isSell ? MESSAGE_LIMIT_SELL : MESSAGE_LIMIT_BUY, differentialQuantity(&g, 10, 200, 5000), price);
+			differentialEventText = isSell ? "user limit sell" : "user limit buy";
+			executeMessage(&m, t);
+			referenceUserMessage(&m, t);
+		}
+		else if (kind < 97) {
+			u32 size = differentialMarketSize(&g, isSell, t);
+			if (size == 0) continue;
+			orderMessage m = userMessage(isSell ? MESSAGE_MARKET_SELL : MESSAGE_MARKET_BUY, size, PRICE_AT_TOUCH);
+			differentialEventText = isSell ? "user market sell" : "user market buy";
+			executeMessage(&m, t);
+			referenceUserMessage(&m, t);
+		}
+		else {
+			orderMessage m = userMessage(MESSAGE_CANCEL_ALL, 0, PRICE_AT_TOUCH);
+			differentialEventText = "user cancel";
+			executeMessage(&m, t);
+			referenceUserMessage(&m, t);
+		}
+		compactStep(t);
+		checkAgainstReference();
+	}
+}
+
+// Check differentialSeeds streams against the reference book, each in its own process with at most differentialWorkers running at once.
+// A stream stops at its first difference and prints it.
+void runDifferential() {
+	u64 t0 = getTime();
+	int failed = 0;
+#ifdef __linux
+	int workers = differentialWorkers > 0 ? differentialWorkers : (int)sysconf(_SC_NPROCESSORS_ONLN);
+	u32 next = 0;
+	int running = 0;
+	while (next < differentialSeeds || running > 0) {
+		while (running < workers && next < differentialSeeds) {
+			fflush(stdout);
+			pid_t pid = fork();
+			if (pid == 0) {
+				runDifferentialStream(differentialFirstSeed + next);
+				exit(0);
+			}
+			if (pid < 0) {
+				printf("ERROR: Could not start a worker for the reference book check.\n");
+				exit(1);
+			}
+			next++;
+			running++;
+		}
+		int status;
+		if (wait(&status) < 0) break;
+		running--;
+		if (!WIFEXITED(status) || WEXITSTATUS(status) != 0) failed++;
+	}
+#else
+	// Without fork, check every stream in this process. The first difference ends the run.
+	for (u32 i = 0; i < differentialSeeds; i++) {
+		runDifferentialStream(differentialFirstSeed + i);
+	}
+#endif
+	double seconds = (double)(getTime() - t0) / 1e9;
+	u64 events = (u64)differentialSeeds * differentialEvents;
+	printf("%u streams of %llu events checked against the reference book, %i with differences. %.2f s, %.2f million events per second.\n",
+		differentialSeeds, differentialEvents, failed, seconds, (double)events / seconds / 1e6);
+}
+
+// Metrics endpoint: a thread answering HTTP requests on localhost with the simulator's metrics in Prometheus' text format.
+// It only reads counters that other threads write to cache lines of their own, so a scrape never makes the main loop wait.
+#if defined(_WIN32)
+typedef SOCKET metricsSocket;
+#define closeMetricsSocket closesocket
+HANDLE metricsHandle;
+#else
+typedef int metricsSocket;
+#define INVALID_SOCKET (-1)
+#define closeMetricsSocket close
+pthread_t metricsHandle;
+#endif
+metricsSocket metricsListener = INVALID_SOCKET;
+
+// What the metrics thread saw at the previous scrape, for rates and for the latency of recent orders.
+u64 lastScrapeTime = 0;
+u64 lastScrapeEvents = 0;
+u64 lastScrapeLatency[LATENCY_BUCKETS];
+
+// Append to the response being built in buffer.
+void appendMetrics(char* buffer, u64 size, u64* used, const char* format, ...) {
+	va_list args;
+	va_start(args, format);
+	int n = vsnprintf(buffer + *used, size - *used, format, args);
+	va_end(args);
+	if (n > 0) {
+		*used = *used + n < size ? *used + n : size - 1;
+	}
+}
+
+// Write the HELP and TYPE lines of a metric.
+void describeMetric(char* buffer, u64 size, u64* used, const char* name, const char* type, const char* help) {
+	appendMetrics(buffer, size, used, "# HELP orderbook_%s %s\n# TYPE orderbook_%s %s\n", name, help, name, type);
+}
+
+// Build the whole response body. Returns its length.
+u64 buildMetrics(char* buffer, u64 size) {
+	u64 used = 0;
+	u64 now = getTime();
+	u64 events = loadRelaxed(metrics.m.events);
+
+	describeMetric(buffer, size, &used, "events_total", "counter", "Participant orders processed.");
+	appendMetrics(buffer, size, &used, "orderbook_events_total %llu\n", events);
+	describeMetric(buffer, size, &used, "events_per_second", "gauge", "Participant orders processed per second of wall time since the previous scrape.");
+	double seconds = (double)(now - lastScrapeTime) / 1e9;
+	appendMetrics(buffer, size, &used, "orderbook_events_per_second %.1f\n",
+		lastScrapeTime > 0 && seconds > 0 ? (double)(events - lastScrapeEvents) / seconds : 0.0);
+	describeMetric(buffer, size, &used, "frames_total", "counter", "Frames at which the whole book was brought up to date.");
+	appendMetrics(buffer, size, &used, "orderbook_frames_total %llu\n", loadRelaxed(metrics.m.frames));
+	describeMetric(buffer, size, &used, "frame_overruns_total", "counter", "Printed frames for which the main loop could not keep up with the clock.");
+	appendMetrics(buffer, size, &used, "orderbook_frame_overruns_total %llu\n", loadRelaxed(metrics.m.frameOverruns));
+	describeMetric(buffer, size, &used, "resting_orders", "gauge", "Orders in the continuous book at the last frame.");
+	appendMetrics(buffer, size, &used, "orderbook_resting_orders %llu\n", loadRelaxed(metrics.m.restingOrders));
+	describeMetric(buffer, size, &used, "pool_capacity_orders", "gauge", "Orders the pool can hold.");
+	appendMetrics(buffer, size, &used, "orderbook_pool_capacity_orders %d\n", poolSize);
+	describeMetric(buffer, size, &used, "pool_high_water_orders", "gauge", "Orders of the pool ever used, at the last frame.");
+	appendMetrics(buffer, size, &used, "orderbook_pool_high_water_orders %llu\n", loadRelaxed(metrics.m.poolHighWater));
+	describeMetric(buffer, size, &used, "pool_free_orders", "gauge", "Orders below the high water mark free to be reused, at the last frame.");
+	appendMetrics(buffer, size, &used, "orderbook_pool_free_orders %llu\n", loadRelaxed(metrics.m.poolFree));
+	describeMetric(buffer, size, &used, "bid_cents", "gauge", "The bid at the last frame.");
+	appendMetrics(buffer, size, &used, "orderbook_bid_cents %llu\n", loadRelaxed(metrics.m.bid));
+	describeMetric(buffer, size, &used, "ask_cents", "gauge", "The ask at the last frame.");
+	appendMetrics(buffer, size, &used, "orderbook_ask_cents %llu\n", loadRelaxed(metrics.m.ask));
+
+	// Quantiles of the orders processed since the previous scrape, or of every order if there were none. Each is the upper bound
+	// of its power-of-two bucket.
+	u64 buckets[LATENCY_BUCKETS], total = 0, recent = 0;
+	for (int b = 0; b < LATENCY_BUCKETS; b++) {
+		buckets[b] = loadRelaxed(metrics.m.latency[b]);
+		total += buckets[b];
+		recent += buckets[b] - lastScrapeLatency[b];
+	}
+	describeMetric(buffer, size, &used, "event_latency_seconds", "summary", "Wall time spent processing each participant order, by quantile of the orders since the previous scrape.");
+	double quantiles[4] = { 0.5, 0.9, 0.99, 0.999 };
+	for (int q = 0; q < 4; q++) {
+		u64 n = recent > 0 ? recent : total;
+		u64 rank = (u64)ceil(quantiles[q] * (double)n), seen = 0;
+		int b = 0;
+		while (b < LATENCY_BUCKETS - 1) {
+			seen += recent > 0 ? buckets[b] - lastScrapeLatency[b] : buckets[b];
+			if (seen >= rank && seen > 0) break;
+			b++;
+		}
+		appendMetrics(buffer, size, &used, "orderbook_event_latency_seconds{quantile=\"%g\"} %.9f\n", quantiles[q],
+			n > 0 ? (double)((u64)1 << b) / 1e9 : 0.0);
+	}
+	appendMetrics(buffer, size, &used, "orderbook_event_latency_seconds_sum %.9f\n", (double)loadRelaxed(metrics.m.latencySum) / 1e9);
+	appendMetrics(buffer, size, &used, "orderbook_event_latency_seconds_count %llu\n", total);
+
+	if (journalDescriptor >= 0) {
+		// Whatever the journal's stream holds beyond the file's size hasn't been written out yet.
+		u64 written = loadRelaxed(metrics.m.journalBytes);
+#if defined(_WIN32)
+		struct _stat64 st;
+		u64 onDisk = _fstat64(journalDescriptor, &st) == 0 ? (u64)st.st_size : 0;
+#else
+		struct stat st;
+		u64 onDisk = fstat(journalDescriptor, &st) == 0 ? (u64)st.st_size : 0;
+#endif
+		describeMetric(buffer, size, &used, "journal_bytes_total", "counter", "Bytes written to the journal.");
+		appendMetrics(buffer, size, &used, "orderbook_journal_bytes_total %llu\n", written);
+		describeMetric(buffer, size, &used, "journal_lag_bytes", "gauge", "Bytes of the journal still buffered in the process.");
+		appendMetrics(buffer, size, &used, "orderbook_journal_lag_bytes %llu\n", written > onDisk ? written - onDisk : 0);
+	}
+	if (pipelineGeneration) {
+		describeMetric(buffer, size, &used, "generated_orders_total", "counter", "Participant orders drawn by the generator thread this session.");
+		appendMetrics(buffer, size, &used, "orderbook_generated_orders_total %llu\n", loadRelaxed(generatedPositions.written));
+	}
+	if (numBookReaders > 0) {
+		describeMetric(buffer, size, &used, "book_reader_walks_total", "counter", "Walks of the book by each reader thread.");
+		for (int i = 0; i < numBookReaders; i++) {
+			appendMetrics(buffer, size, &used, "orderbook_book_reader_walks_total{reader=\"%d\"} %llu\n", i, loadRelaxed(bookReaders[i].passes));
+		}
+	}
+	u64 producers = loadRelaxed(numIngressProducers);
+	if (producers > 0) {
+		describeMetric(buffer, size, &used, "ingress_orders_total", "counter", "Orders sent through the ingress queue by each producer thread.");
+		for (u64 i = 0; i < producers && i < MAX_INGRESS_PRODUCERS; i++) {
+			appendMetrics(buffer, size, &used, "orderbook_ingress_orders_total{producer=\"%llu\"} %llu\n", i, loadRelaxed(ingressProducers[i].sent));
+		}
+	}
+
+	lastScrapeTime = now;
+	lastScrapeEvents = events;
+	memcpy(lastScrapeLatency, buckets, sizeof(buckets));
+	return used;
+}
+
+// Send all of data to a scraper. Returns 0 if it hung up first.
+bool sendMetrics(metricsSocket client, const char* data, u64 size) {
+	while (size > 0) {
+#if defined(_WIN32)
+		int n = send(client, data, (int)size, 0);
+#else
+		int n = (int)send(client, data, size, MSG_NOSIGNAL); // A scraper hanging up must not kill the process with SIGPIPE.
+#endif
+		if (n <= 0) return 0;
+		data += n;
+		size -= n;
+	}
+	return 1;
+}
+
+// Answer requests one at a time. Anything but GET /metrics gets a 404.
+#if defined(_WIN32)
+DWORD WINAPI metricsThread(LPVOID arg) {
+#else
+void* metricsThread(void* arg) {
+#endif
+	u64 size = 65536;
+	char* body = (char*)malloc(size);
+	char request[1024];
+	char header[256];
+	while (1) {
+		metricsSocket client = accept(metricsListener, NULL, NULL);
+		if (client == INVALID_SOCKET) continue;
+
+		// Don't let a client that never finishes its request hold up the next scrape.
+#if defined(_WIN32)
+		DWORD timeout = 1000;
+#else
+		struct timeval timeout = { 1, 0 };
+#endif
+		setsockopt(client, SOL_SOCKET, SO_RCVTIMEO, (const char*)&timeout, sizeof(timeout));
+		u64 received = 0;
+		while (received < sizeof(request) - 1) {
+			int n = (int)recv(client, request + received, (int)(sizeof(request) - 1 - received), 0);
+			if (n <= 0) break;
+			received += n;
+			request[received] = 0;
+			if (strstr(request, "\r\n\r\n") != NULL) break;
+		}
+		request[received] = 0;
+
+		if (strncmp(request, "GET /metrics ", 13) == 0 || strncmp(request, "GET /metrics?", 13) == 0) {
+			u64 length = buildMetrics(body, size);
+			int n = snprintf(header, sizeof(header), "HTTP/1.1 200 OK\r\nContent-Type: text/plain; version=0.0.4; charset=utf-8\r\n"
+				"Content-Length: %llu\r\nConnection: close\r\n\r\n", length);
+			if (sendMetrics(client, header, n)) sendMetrics(client, body, length);
+		}
+		else {
+			const char* notFound = "HTTP/1.1 404 Not Found\r\nContent-Type: text/plain\r\nContent-Length: 10\r\nConnection: close\r\n\r\nNot found\n";
+			sendMetrics(client, notFound, strlen(notFound));
+		}
+		closeMetricsSocket(client);
+	}
+	return 0;
+}
+
+// Listen on metricsPort on localhost and start the thread answering scrapes. It runs until the program exits.
+void startMetricsServer() {
+#if defined(_WIN32)
+	WSADATA wsa;
+	if (WSAStartup(MAKEWORD(2, 2), &wsa) != 0) {
+		printf("ERROR: Could not start Winsock.\n");
+		exit(1);
+	}
+	BOOL yes = 1;
+#else
+	int yes = 1;
+#endif
+	metricsListener = socket(AF_INET, SOCK_STREAM, 0);
+	setsockopt(metricsListener, SOL_SOCKET, SO_REUSEADDR, (const char*)&yes, sizeof(yes));
+	struct sockaddr_in address;
+	memset(&address, 0, sizeof(address));
+	address.sin_family = AF_INET;
+	address.sin_port = htons((unsigned short)metricsPort);
+	address.sin_addr.s_addr = htonl(INADDR_LOOPBACK);
+	if (metricsListener == INVALID_SOCKET || bind(metricsListener, (struct sockaddr*)&address, sizeof(address)) != 0 || listen(metricsListener, 16) != 0) {
+		printf("ERROR: Could not listen for metrics on port %d.\n", metricsPort);
+		exit(1);
+	}
+#if defined(_WIN32)
+	metricsHandle = CreateThread(NULL, 0, metricsThread, NULL, 0, NULL);
+	if (metricsHandle == NULL) {
+#else
+	if (pthread_create(&metricsHandle, NULL, metricsThread, NULL) != 0) {
+#endif
+		printf("ERROR: Could not start the metrics thread.\n");
+		exit(1);
+	}
+}
+
+// Callbacks that do nothing, for measuring the cost of dispatching to a strategy when none is loaded.
+void noopFill(void* state, u32 p, u32 size, bool isBuy) {}
+void noopTopOfBook(void* state, u32 bid, u32 ask) {}
+void noopTimer(void* state, u64 t) {}
+
+// Measure the time taken to dispatch each kind of strategy callback.
+void benchmarkStrategyDispatch() {
+	if (!strategyLoaded) {
+		strategy.onFill = noopFill;
+		strategy.onTopOfBook = noopTopOfBook;
+		strategy.onTimer = noopTimer;
+	}
+	int n = 10000000;
+
+	u64 t0 = getTime();
+	for (int i = 0; i < n; i++) {
+		strategyFill(bid, 1, i & 1);
+	}
+	u64 t1 = getTime();
+	for (int i = 0; i < n; i++) {
+		strategyTopOfBook();
+	}
+	u64 interval = strategy.timerIntervalNS;
+	strategy.timerIntervalNS = 1;
+	nextStrategyTimer = 0;
+	u64 t2 = getTime();
+	runStrategy(0);
+	runStrategy(n);
+	u64 t3 = getTime();
+	strategy.timerIntervalNS = interval;
+
+	printf("Strategy dispatch (%s):\n", strategyLoaded ? strategyPluginPath : "no-op callbacks");
+	printf("  onFill:      %6.2f ns\n", (double)(t1 - t0) / n);
+	printf("  onTopOfBook: %6.2f ns\n", (double)(t2 - t1) / n);
+	if (strategy.onTimer != NULL) {
+		printf("  onTimer:     %6.2f ns\n", (double)(t3 - t2) / n);
+	}
+
+	numPendingStrategyOrders = 0;
+	if (!strategyLoaded) {
+		memset(&strategy, 0, sizeof(strategy));
+	}
+}
+
+// Sort u64s in increasing order with qsort.
+int compareU64(const void* a, const void* b) {
+	u64 x = *(const u64*)a, y = *(const u64*)b;
+	return x < y ? -1 : x > y;
+}
+
+// A pathological workload for the benchmark suite. begin builds the book once, prepare runs untimed before each operation,
+// and each operation is timed on its own so that the tail of the latency distribution can be reported.
+typedef struct {
+	char* name;
+	int numOperations;
+	void (*begin)();
+	void (*prepare)(int i);
+	void (*operation)(int i);
+} workloadScenario;
+
+#define WORKLOAD_PRICE 50000 // Middle of the book in every workload, far from both ends of the price range.
+#define WORKLOAD_SWEEP_LEVELS 5000
+#define WORKLOAD_EXPIRY_ORDERS 20000
+#define WORKLOAD_EXPIRY_LEVELS 200
+u64 workloadTime = 0;
+
+// A book with a bid and ask that never expire, for workloads that need the touch to exist.
+void workloadTwoSidedBook() {
+	resetBook();
+	startSession(0);
+	workloadTime = 1000000000;
+	for (u32 p = WORKLOAD_PRICE - 10; p < WORKLOAD_PRICE; p++) {
+		addLimitOrder(p, 1000, ULLONG_MAX, 0);
+	}
+	for (u32 p = WORKLOAD_PRICE + 1; p <= WORKLOAD_PRICE + 10; p++) {
+		addLimitOrder(p, 1000, ULLONG_MAX, 0);
+	}
+	bid = WORKLOAD_PRICE - 1;
+	ask = WORKLOAD_PRICE + 1;
+}
+
+// Orders queueing at one price, so that every add walks to the back of an ever longer queue.
+void deepQueueBegin() {
+	workloadTwoSidedBook();
+}
+
+void deepQueueOperation(int i) {
+	addLimitOrder(WORKLOAD_PRICE - 1, 1, ULLONG_MAX, 0);
+}
+
+// Market orders that sweep thousands of one-share levels.
+void wideSweepBegin() {
+	resetBook();
+	startSession(0);
+	addLimitOrder(WORKLOAD_PRICE - 1, 1000, ULLONG_MAX, 0);
+	bid = WORKLOAD_PRICE - 1;
+}
+
+void wideSweepPrepare(int i) {
+	for (u32 p = WORKLOAD_PRICE; p < WORKLOAD_PRICE + WORKLOAD_SWEEP_LEVELS; p++) {
+		addLimitOrder(p, 1, ULLONG_MAX, 0);
+	}
+	ask = WORKLOAD_PRICE;
+}
+
+void wideSweepOperation(int i) {
+	marketBuy(WORKLOAD_SWEEP_LEVELS, workloadTime);
+}
+
+// Many orders expiring at the same moment, removed by a single frame update.
+void massExpiryBegin() {
+	workloadTwoSidedBook();
+}
+
+void massExpiryPrepare(int i) {
+	workloadTime += frameLengthNS;
+	for (int k = 0; k < WORKLOAD_EXPIRY_ORDERS; k++) {
+		addLimitOrder(WORKLOAD_PRICE - 11 - k % WORKLOAD_EXPIRY_LEVELS, 1, workloadTime, 0);
+	}
+}
+
+void massExpiryOperation(int i) {
+	updateFrame(workloadTime);
+}
+
+// The user alternately adding a limit order and cancelling everything.
+void addCancelStormBegin() {
+	workloadTwoSidedBook();
+}
+
+void addCancelStormOperation(int i) {
+	workloadTime++;
+	if (i % 2 == 0) {
+		sendUserMessage(MESSAGE_LIMIT_BUY, 1, workloadTime);
+	}
+	else {
+		sendUserMessage(MESSAGE_CANCEL_ALL, 0, workloadTime);
+		updateLimitOrders(bid, workloadTime);
+	}
+}
+
+workloadScenario workloadScenarios[] = {
+	{ "Deep queue (100k at one price)", 100000, deepQueueBegin, NULL, deepQueueOperation },
+	{ "Wide sweep (5000 levels)", 200, wideSweepBegin, wideSweepPrepare, wideSweepOperation },
+	{ "Mass expiry (20000 orders)", 200, massExpiryBegin, massExpiryPrepare, massExpiryOperation },
+	{ "Add/cancel storm", 1000000, addCancelStormBegin, NULL, addCancelStormOperation },
+};
+
+// Run one workload scenario, with readers walking the book during it if readers > 0, and sort the latencies of its operations.
+// Return their total.
+u64 runWorkload(workloadScenario* w, u64* latencies, int readers) {
+	w->begin();
+	if (readers > 0) {
+		startBookReaders(readers);
+	}
+
+	u64 total = 0;
+	for (int i = 0; i < w->numOperations; i++) {
+		if (w->prepare != NULL) {
+			w->prepare(i);
+		}
+		// The operations skip beginEvent, so move the epoch on here as it would.
+		u64 t0 = getTime();
+		if (epochReclamation) {
+			advanceEpoch();
+		}
+		w->operation(i);
+		latencies[i] = getTime() - t0;
+		total += latencies[i];
+	}
+
+	if (readers > 0) {
+		stopAllBookReaders();
+	}
+	qsort(latencies, w->numOperations, sizeof(u64), compareU64);
+	return total;
+}
+
+// Run every workload scenario and print the latency distribution of its operations.
+void benchmarkWorkloads() {
+	int numScenarios = sizeof(workloadScenarios) / sizeof(workloadScenario);
+	printf("%-34s %10s %10s %10s %10s %10s %10s\n", "Workload (ns per operation)", "Mean", "p50", "p99", "p99.9", "p99.99", "Max");
+
+	for (int k = 0; k < numScenarios; k++) {
+		workloadScenario* w = &workloadScenarios[k];
+		u64* latencies = (u64*)malloc(w->numOperations * sizeof(u64));
+		u64 total = runWorkload(w, latencies, 0);
+		int n = w->numOperations;
+		printf("%-34s %10.0f %10llu %10llu %10llu %10llu %10llu\n", w->name, (double)total / n, latencies[n / 2], latencies[(int)(n * 0.99)],
+			latencies[(int)(n * 0.999)], latencies[(int)(n * 0.9999)], latencies[n - 1]);
+		free(latencies);
+	}
+}
+
+// Compare the matching loop's latency without epoch-based reclamation, with it but nobody reading, and with two threads reading the book.
+void benchmarkBookReaders() {
+	int numScenarios = sizeof(workloadScenarios) / sizeof(workloadScenario);
+	const char* modes[3] = { "no epochs", "epochs", "epochs + 2 readers" };
+	printf("%-34s %-20s %10s %10s %10s %12s\n", "Workload (ns per operation)", "Reclamation", "Mean", "p50", "p99", "Reader walks");
+
+	for (int k = 0; k < numScenarios; k++) {
+		workloadScenario* w = &workloadScenarios[k];
+		u64* latencies = (u64*)malloc(w->numOperations * sizeof(u64));
+		for (int m = 0; m < 3; m++) {
+			epochReclamation = m > 0;
+			u64 total = runWorkload(w, latencies, m == 2 ? 2 : 0);
+			u64 walks = m == 2 ? bookReaders[0].passes + bookReaders[1].passes : 0;
+			int n = w->numOperations;
+			printf("%-34s %-20s %10.0f %10llu %10llu %12llu\n", m == 0 ? w->name : "", modes[m], (double)total / n, latencies[n / 2],
+				latencies[(int)(n * 0.99)], walks);
+		}
+		epochReclamation = 0;
+		free(latencies);
+	}
+}
+
+// Start counting the calling thread's data TLB misses. Return -1 if the system doesn't allow it.
+int openTLBMissCounter() {
+#ifdef __linux
+	struct perf_event_attr attr;
+	memset(&attr, 0, sizeof(attr));
+	attr.type = PERF_TYPE_HW_CACHE;
+	attr.size = sizeof(attr);
+	attr.config = PERF_COUNT_HW_CACHE_DTLB | (PERF_COUNT_HW_CACHE_OP_READ << 8) | (PERF_COUNT_HW_CACHE_RESULT_MISS << 16);
+	attr.exclude_kernel = 1;
+	attr.exclude_hv = 1;
+	return (int)syscall(SYS_perf_event_open, &attr, 0, -1, -1, 0);
+#else
+	return -1;
+#endif
+}
+
+u64 readCounter(int fd) {
+	u64 count = 0;
+#ifdef __linux
+	if (read(fd, &count, sizeof(count)) != sizeof(count)) count = 0;
+#endif
+	return count;
+}
+
+u64 benchmarkChecksum = 0; // Results of benchmark loops are stored here so that the compiler can't remove them.
+
+// Chase pointers through a pool of poolSize orders in random order, as sweeps and expiries touch orders scattered across the pool,
+// once with each page size, and compare the time and data TLB misses per order.
+void benchmarkHugePages() {
+	u64 steps = 20000000;
+	u32* order = (u32*)malloc(poolSize * sizeof(u32));
+	printf("%-24s %-24s %10s %18s\n", "Pool pages (requested)", "Pool pages (used)", "ns/order", "dTLB misses/order");
+
+	for (int requested = HUGE_PAGES_NONE; requested <= HUGE_PAGES_EXPLICIT; requested++) {
+		int mode = requested;
+		u64 size = (u64)poolSize * sizeof(limitOrder);
+		limitOrder* pool = (limitOrder*)allocateMemory(size, &mode, 0);
+
+		// Link the orders into one random cycle.
+		for (int i = 0; i < poolSize; i++) {
+			order[i] = i;
+		}
+		for (int i = poolSize - 1; i > 0; i--) {
+			int j = rand64() % (i + 1);
+			u32 x = order[i];
+			order[i] = order[j];
+			order[j] = x;
+		}
+		for (int i = 0; i < poolSize; i++) {
+			pool[order[i]].next = &pool[order[(i + 1) % poolSize]];
+		}
+
+		int counter = openTLBMissCounter();
+		u64 t0 = getTime();
+		limitOrder* curr = &pool[order[0]];
+		u64 sum = 0;
+		for (u64 k = 0; k < steps; k++) {
+			sum += curr->size;
+			curr = curr->next;
+		}
+		u64 t1 = getTime();
+		benchmarkChecksum += sum;
+		char misses[32] = "unavailable";
+		if (counter >= 0) {
+			snprintf(misses, sizeof(misses), "%.3f", (double)readCounter(counter) / steps);
+#ifdef __linux
+			close(counter);
+#endif
+		}
+		printf("%-24s %-24s %10.2f %18s\n", hugePagesText[requested], hugePagesText[mode], (double)(t1 - t0) / steps, misses);
+		freeMemory(pool, size, mode);
+	}
+	free(order);
+}
+
+// A price level stored as a ring of compact order slots instead of a linked list, so that fills and scans read memory in order.
+// Orders removed from the middle of the queue are left as tombstones and squeezed out once they make up half the ring.
+typedef struct {
+	u32 size; // 0 for a tombstone.
+	u32 user;
+	u64 expirationTime;
+} ringSlot;
+
+typedef struct {
+	ringSlot* slots;
+	u32 capacity; // Always a power of two.
+	u32 head; // The first order to be filled is at slots[head & (capacity - 1)]. head and tail only ever grow.
+	u32 tail;
+	u32 tombstones;
+} levelRing;
+
+// Move the live orders to the front of the queue, dropping the tombstones between them.
+void ringCompact(levelRing* r) {
+	u32 mask = r->capacity - 1;
+	u32 out = r->head;
+	for (u32 i = r->head; i != r->tail; i++) {
+		ringSlot s = r->slots[i & mask];
+		if (s.size != 0) {
+			r->slots[out++ & mask] = s;
+		}
+	}
+	r->tail = out;
+	r->tombstones = 0;
+}
+
+// Double the ring's capacity, unwrapping it to start at slot 0.
+void ringGrow(levelRing* r) {
+	u32 n = r->tail - r->head;
+	u32 capacity = r->capacity > 0 ? r->capacity * 2 : 8;
+	ringSlot* slots = (ringSlot*)malloc(capacity * sizeof(ringSlot));
+	for (u32 i = 0; i < n; i++) {
+		slots[i] = r->slots[(r->head + i) & (r->capacity - 1)];
+	}
+	free(r->slots);
+	r->slots = slots;
+	r->capacity = capacity;
+	r->head = 0;
+	r->tail = n;
+}
+
+// Add an order to the back of the queue.
+void ringPush(levelRing* r, u32 size, u64 expirationTime, bool user) {
+	if (r->tail - r->head == r->capacity) {
+		if (r->capacity > 0 && r->tombstones * 4 >= r->capacity) ringCompact(r);
+		else ringGrow(r);
+	}
+	ringSlot* s = &r->slots[r->tail++ & (r->capacity - 1)];
+	s->size = size;
+	s->user = user;
+	s->expirationTime = expirationTime;
+}
+
+// Drop tombstones from the front of the queue so that the head is always a live order.
+void ringTrimFront(levelRing* r) {
+	while (r->head != r->tail && r->slots[r->head & (r->capacity - 1)].size == 0) {
+		r->head++;
+		r->tombstones--;
+	}
+}
+
+// Remove every order that has expired by time t, the ring version of updateLimitOrders.
+void ringExpire(levelRing* r, u64 t) {
+	u32 mask = r->capacity - 1;
+	for (u32 i = r->head; i != r->tail; i++) {
+		ringSlot* s = &r->slots[i & mask];
+		if (s->size != 0 && s->expirationTime <= t) {
+			s->size = 0;
+			r->tombstones++;
+		}
+	}
+	ringTrimFront(r);
+	if (r->tombstones * 2 > r->tail - r->head) {
+		ringCompact(r);
+	}
+}
+
+// Fill orders at price p until size becomes 0 or the level is empty, the ring version of fillOrders.
+void ringFill(levelRing* r, u32 p, u32* size, u32* o) {
+	u32 mask = r->capacity - 1;
+	while (*size > 0 && r->head != r->tail) {
+		ringSlot* s = &r->slots[r->head & mask];
+		if (s->size == 0) {
+			r->head++;
+			r->tombstones--;
+		}
+		else if (*size >= s->size) {
+			*o += s->size * p;
+			*size -= s->size;
+			r->head++;
+		}
+		else {
+			*o += *size * p;
+			s->size -= *size;
+			*size = 0;
+		}
+	}
+	ringTrimFront(r);
+}
+
+// Total shares resting in the ring, as the depth loop in printOrderBook adds them up.
+u32 ringVolume(levelRing* r) {
+	u32 mask = r->capacity - 1;
+	u32 x = 0;
+	for (u32 i = r->head; i != r->tail; i++) {
+		x += r->slots[i & mask].size;
+	}
+	return x;
+}
+
+// Compare the linked-list levels with ring levels holding the same orders, at several queue depths.
+// The list nodes are linked in a random order across the pool, as they end up after the pool has been in use for a while.
+// Each level is scanned for its volume, then a tenth of its orders expire, then the whole level is filled.
+void benchmarkLevelRings() {
+	u32 depths[5] = { 1, 10, 100, 1000, 10000 };
+	u32 firstPrice = 1000;
+	printf("%-28s %10s %10s %10s %10s %10s %10s\n", "Level queue (ns per order)", "List scan", "Ring scan", "List exp.", "Ring exp.", "List fill", "Ring fill");
+
+	for (int d = 0; d < 5; d++) {
+		u32 depth = depths[d];
+		u32 levels = 500000 / depth < 4096 ? 500000 / depth : 4096;
+		u32 n = depth * levels;
+		resetBook();
+
+		// Take n orders from the pool, shuffle them and deal them out to the levels.
+		limitOrder** orders = (limitOrder**)malloc(n * sizeof(limitOrder*));
+		for (u32 i = 0; i < n; i++) {
+			orders[i] = newLimitOrder(0, 0, 0, 0);
+		}
+		for (u32 i = n - 1; i > 0; i--) {
+			u32 j = rand64() % (i + 1);
+			limitOrder* x = orders[i];
+			orders[i] = orders[j];
+			orders[j] = x;
+		}
+		levelRing* rings = (levelRing*)calloc(levels, sizeof(levelRing));
+		for (u32 l = 0; l < levels; l++) {
+			u32 p = firstPrice + l;
+			limitOrder** link = &limitOrderHead[p];
+			for (u32 k = 0; k < depth; k++) {
+				limitOrder* lo = orders[l * depth + k];
+				lo->p = p;
+				lo->size = 1 + rand64() % 20;
+				lo->expirationTime = rand64() % 10 == 0 ? 1 : ULLONG_MAX;
+				lo->user = 0;
+				*link = lo;
+				link = &lo->next;
+				ringPush(&rings[l], lo->size, lo->expirationTime, 0);
+			}
+			*link = NULL;
+			recountLevel(p);
+		}
+
+		u64 times[6];
+		u64 x = 0;
+		u64 t0 = getTime();
+		for (u32 l = 0; l < levels; l++) {
+			for (limitOrder* curr = limitOrderHead[firstPrice + l]; curr != NULL; curr = curr->next) {
+				x += curr->size;
+			}
+		}
+		times[0] = getTime() - t0;
+		t0 = getTime();
+		for (u32 l = 0; l < levels; l++) {
+			x -= ringVolume(&rings[l]);
+		}
+		times[1] = getTime() - t0;
+
+		t0 = getTime();
+		for (u32 l = 0; l < levels; l++) {
+			updateLimitOrders(firstPrice + l, 1);
+		}
+		times[2] = getTime() - t0;
+		t0 = getTime();
+		for (u32 l = 0; l < levels; l++) {
+			ringExpire(&rings[l], 1);
+		}
+		times[3] = getTime() - t0;
+
+		u32 o = 0;
+		t0 = getTime();
+		for (u32 l = 0; l < levels; l++) {
+			u32 size = UINT_MAX;
+			fillOrders(firstPrice + l, &size, &o, 0);
+		}
+		times[4] = getTime() - t0;
+		t0 = getTime();
+		for (u32 l = 0; l < levels; l++) {
+			u32 size = UINT_MAX;
+			ringFill(&rings[l], firstPrice + l, &size, &o);
+		}
+		times[5] = getTime() - t0;
+		benchmarkChecksum += x + o;
+
+		char label[32];
+		snprintf(label, sizeof(label), "Depth %u (%u levels)", depth, levels);
+		printf("%-28s", label);
+		for (int k = 0; k < 6; k++) {
+			printf(" %10.2f", (double)times[k] / n);
+		}
+		printf("\n");
+
+		for (u32 l = 0; l < levels; l++) {
+			free(rings[l].slots);
+		}
+		free(rings);
+		free(orders);
+	}
+	resetBook();
+}
+
+// Time a walk through every order in the book, in ns per order.
+double benchmarkTraversal(u32 firstPrice, u32 levels) {
+	u64 x = 0;
+	u64 n = 0;
+	u64 t0 = getTime();
+	for (int r = 0; r < 5; r++) {
+		for (u32 p = firstPrice; p < firstPrice + levels; p++) {
+			for (limitOrder* curr = limitOrderHead[p]; curr != NULL; curr = curr->next) {
+				x += curr->size;
+				n++;
+			}
+		}
+	}
+	benchmarkChecksum += x;
+	return (double)(getTime() - t0) / n;
+}
+
+// Scatter a book across the pool as long runs of LIFO reuse do, then compact it and compare how fast the book can be walked.
+void benchmarkCompaction() {
+	u32 levels = 200;
+	u32 depth = 500;
+	u32 firstPrice = 1000;
+	u32 n = levels * depth;
+	resetBook();
+
+	// Take twice as many orders as will rest, shuffle them, deal half out to the levels and free the rest.
+	limitOrder** orders = (limitOrder**)malloc(2 * n * sizeof(limitOrder*));
+	for (u32 i = 0; i < 2 * n; i++) {
+		orders[i] = newLimitOrder(0, 0, ULLONG_MAX, 0);
+	}
+	for (u32 i = 2 * n - 1; i > 0; i--) {
+		u32 j = rand64() % (i + 1);
+		limitOrder* x = orders[i];
+		orders[i] = orders[j];
+		orders[j] = x;
+	}
+	for (u32 l = 0; l < levels; l++) {
+		u32 p = firstPrice + l;
+		limitOrder** link = &limitOrderHead[p];
+		for (u32 k = 0; k < depth; k++) {
+			limitOrder* lo = orders[l * depth + k];
+			lo->p = p;
+			lo->size = 1 + rand64() % 20;
+			*link = lo;
+			link = &lo->next;
+		}
+		*link = NULL;
+		recountLevel(p);
+	}
+	for (u32 i = n; i < 2 * n; i++) {
+		freeLimitOrder(orders[i]);
+	}
+	free(orders);
+
+	double before = benchmarkTraversal(firstPrice, levels);
+
+	u64 slices = 0;
+	u64 longest = 0;
+	u64 total = 0;
+	startCompaction();
+	while (compactActive) {
+		u64 t0 = getTime();
+		compactSlice();
+		u64 t1 = getTime() - t0;
+		if (t1 > longest) longest = t1;
+		total += t1;
+		slices++;
+	}
+
+	double after = benchmarkTraversal(firstPrice, levels);
+	printf("Compaction (%u orders at %u levels):\n", n, levels);
+	printf("  Walking the book: %.2f ns/order before, %.2f ns/order after\n", before, after);
+	printf("  %llu slices of up to %d orders, %.0f ns each on average, %llu ns at most\n", slices, compactionSliceOrders, (double)total / slices, longest);
+	resetBook();
+}
+
+// Spin reading the clock for durationNS, as the main loop would, and report how often and for how long the thread was held up.
+void measureJitter(char* label, u64 durationNS) {
+	u64 thresholds[4] = { 1000, 10000, 100000, 1000000 };
+	u64 stalls[4] = { 0, 0, 0, 0 };
+	u64 maxGap = 0;
+	u64 start = getTime();
+	u64 prev = start;
+	while (prev - start < durationNS) {
+		u64 t = getTime();
+		u64 gap = t - prev;
+		for (int k = 0; k < 4 && gap > thresholds[k]; k++) {
+			stalls[k]++;
+		}
+		if (gap > maxGap) maxGap = gap;
+		prev = t;
+	}
+	printf("%-24s %10llu %10llu %10llu %10llu %12llu\n", label, stalls[0], stalls[1], stalls[2], stalls[3], maxGap);
+}
+
+// Compare the stalls seen by an unpinned thread with one pinned to the matching CPU (or CPU 0 if none is set).
+void benchmarkJitter() {
+	int cpu = matchingCPU >= 0 ? matchingCPU : 0;
+	char label[64];
+	snprintf(label, sizeof(label), "Pinned to CPU %d", cpu);
+
+	printf("%-24s %10s %10s %10s %10s %12s\n", "Jitter (stalls per 2 s)", ">1us", ">10us", ">100us", ">1ms", "Max (ns)");
+	pinThread(-1);
+	measureJitter("Unpinned", 2000000000);
+	pinThread(cpu);
+	measureJitter(label, 2000000000);
+	pinThread(matchingCPU);
+}
+
+// Run a busy session of participants with the orders drawn on the main loop and then on the generator thread, from the same seed,
+// and compare their throughput.
+void benchmarkPipelineGeneration() {
+	double delta = averageOrderCreationDeltaNS;
+	averageOrderCreationDeltaNS = 20000;
+	u64 duration = 2000000000;
+	printf("%-28s %12s %14s %12s\n", "Participant orders", "Events", "Events/s", "Final mid");
+
+	for (int pipelined = 0; pipelined <= 1; pipelined++) {
+		resetBook();
+		setSeed(12345);
+		u64 start = 1000000000000ULL;
+		setupMarket(start);
+		startSession(start);
+		pipelineGeneration = pipelined;
+		if (pipelined) {
+			startGeneratorThread(start);
+		}
+
+		u64 next = start, frame = start;
+		u64 t0 = getTime();
+		while (frame - start < duration) {
+			if (next < frame) {
+				participantEvent(&next);
+			}
+			else {
+				updateFrame(frame);
+				frame += frameLengthNS;
+			}
+		}
+		u64 t1 = getTime();
+
+		if (pipelined) {
+			stopGeneratorThread();
+		}
+		printf("%-28s %12llu %14.0f %12.1f\n", pipelined ? "Drawn on a generator thread" : "Drawn between events", numEvents,
+			numEvents / ((double)(t1 - t0) / 1e9), ((double)bid + ask) / 2);
+	}
+	pipelineGeneration = 0;
+	averageOrderCreationDeltaNS = delta;
+}
+
+#define INGRESS_BENCHMARK_MESSAGES 2000000
+int ingressBenchmarkProducers = 0;
+
+#if defined(_WIN32)
+DWORD WINAPI ingressBenchmarkThread(LPVOID arg) {
+#else
+void* ingressBenchmarkThread(void* arg) {
+#endif
+	int id = registerIngressProducer();
+	orderMessage m;
+	memset(&m, 0, sizeof(m));
+	m.type = MESSAGE_LIMIT_BUY;
+	m.size = 1;
+	for (int i = 0; i < INGRESS_BENCHMARK_MESSAGES / ingressBenchmarkProducers; i++) {
+		while (!sendIngress(id, &m)) {
+			yieldThread();
+		}
+	}
+	unregisterIngressProducer(id);
+	return 0;
+}
+
+// Send messages to the main loop from 1 to 32 threads at once and measure how many get through per second.
+// Also check that each producer's messages come out in the order it sent them.
+void benchmarkIngress() {
+	printf("%-10s %14s %12s %14s\n", "Producers", "Messages/s", "ns/message", "Average batch");
+	ingressSlot batch[INGRESS_BATCH];
+	for (int producers = 1; producers <= 32; producers *= 2) {
+		resetIngress();
+		ingressBenchmarkProducers = producers;
+		int perProducer = INGRESS_BENCHMARK_MESSAGES / producers;
+		u64 expected = (u64)perProducer * producers;
+		u64 nextSequence[MAX_INGRESS_PRODUCERS];
+		memset(nextSequence, 0, sizeof(nextSequence));
+#if defined(_WIN32)
+		HANDLE threads[32];
+#else
+		pthread_t threads[32];
+#endif
+
+		u64 t0 = getTime();
+		for (int i = 0; i < producers; i++) {
+#if defined(_WIN32)
+			threads[i] = CreateThread(NULL, 0, ingressBenchmarkThread, NULL, 0, NULL);
+#else
+			pthread_create(&threads[i], NULL, ingressBenchmarkThread, NULL);
+#endif
+		}
+		u64 received = 0, batches = 0;
+		while (received < expected) {
+			int n = takeIngress(batch);
+			if (n == 0) {
+				yieldThread();
+				continue;
+			}
+			for (int i = 0; i < n; i++) {
+				if (batch[i].producerSequence != nextSequence[batch[i].producer]++) {
+					printf("ERROR: Producer %u's messages came out of order.\n", batch[i].producer);
+					exit(1);
+				}
+			}
+			received += n;
+			batches++;
+		}
+		u64 t1 = getTime();
+		for (int i = 0; i < producers; i++) {
+#if defined(_WIN32)
+			WaitForSingleObject(threads[i], INFINITE);
+			CloseHandle(threads[i]);
+#else
+			pthread_join(threads[i], NULL);
+#endif
+		}
+		printf("%-10d %14.0f %12.1f %14.1f\n", producers, received / ((double)(t1 - t0) / 1e9), (double)(t1 - t0) / received,
+			(double)received / batches);
+	}
+	resetIngress();
+}
+
+// Compare drawing from rl with drawing from an alias table over a heavy-tailed histogram of order sizes with spikes at round lots.
+void benchmarkSamplers() {
+	u32 n = 10000;
+	u64* values = (u64*)malloc(n * sizeof(u64));
+	double* weights = (double*)malloc(n * sizeof(double));
+	for (u32 i = 0; i < n; i++) {
+		values[i] = i + 1;
+		weights[i] = pow(i + 1, -1.5) * (values[i] % 100 == 0 ? 20 : values[i] % 10 == 0 ? 4 : 1);
+	}
+	aliasTable a;
+	buildAliasTable(&a, values, weights, n);
+
+	u64 draws = 20000000;
+	printf("%-36s %10s %12s\n", "Sampler", "ns/draw", "Mean");
+	for (int k = 0; k < 2; k++) {
+		u64 sum = 0;
+		u64 t0 = getTime();
+		for (u64 i = 0; i < draws; i++) {
+			sum += k == 0 ? rl(averageLimitOrderSize) : drawAlias(&a);
+		}
+		u64 t1 = getTime();
+		printf("%-36s %10.2f %12.2f\n", k == 0 ? "rl (exponential)" : "Alias table (10000 buckets)", (double)(t1 - t0) / draws, (double)sum / draws);
+		benchmarkChecksum += sum;
+	}
+
+	// Check the table against the histogram's own mean.
+	double mean = 0, total = 0;
+	for (u32 i = 0; i < n; i++) {
+		mean += values[i] * weights[i];
+		total += weights[i];
+	}
+	printf("%-36s %10s %12.2f\n", "Histogram", "", mean / total);
+	free(a.values);
+	free(a.threshold);
+	free(a.alias);
+	free(values);
+	free(weights);
+}
+
+// Compare a quantile sketch with keeping and sorting every value, over 10 million values, in time, memory and accuracy.
+// The values are sketched in 100 parts and merged, as the Monte Carlo workers' sketches are.
+void benchmarkQuantileSketches() {
+	u64 n = 10000000;
+	double* values = (double*)malloc(n * sizeof(double));
+	for (u64 i = 0; i < n; i++) {
+		values[i] = (double)rl(100) + rd();
+	}
+	double fractions[5] = { 0.01, 0.05, 0.5, 0.95, 0.99 };
+
+	u64 t0 = getTime();
+	quantileSketch* total = (quantileSketch*)malloc(sizeof(quantileSketch));
+	quantileSketch* part = (quantileSketch*)malloc(sizeof(quantileSketch));
+	initSketch(total, 1);
+	for (int k = 0; k < 100; k++) {
+		initSketch(part, k + 2);
+		for (u64 i = k * n / 100; i < (k + 1) * n / 100; i++) {
+			sketchAdd(part, values[i]);
+		}
+		mergeSketch(total, part);
+	}
+	double estimates[5];
+	sketchQuantiles(total, fractions, estimates, 5);
+	u64 t1 = getTime();
+
+	double* sorted = (double*)malloc(n * sizeof(double));
+	memcpy(sorted, values, n * sizeof(double));
+	qsort(sorted, n, sizeof(double), compareDouble);
+	u64 t2 = getTime();
+
+	// The rank error of each estimate is how far its rank is from the rank asked for.
+	double worst = 0;
+	for (int k = 0; k < 5; k++) {
+		u64 lo = 0, hi = n;
+		while (lo < hi) {
+			u64 mid = (lo + hi) / 2;
+			if (sorted[mid] < estimates[k]) lo = mid + 1;
+			else hi = mid;
+		}
+		double error = fabs((double)lo / n - fractions[k]);
+		if (error > worst) worst = error;
+	}
+
+	printf("%-24s %10s %14s %16s %16s\n", "Quantiles of 10M values", "Time (ms)", "Memory (KB)", "Worst rank error", "99% error bound");
+	printf("%-24s %10.1f %14.0f %15.3f%% %15.3f%%\n", "Merged sketches", (t1 - t0) / 1e6, sizeof(quantileSketch) / 1024.0, 100 * worst,
+		100 * sketchRankError(total));
+	printf("%-24s %10.1f %14.0f %15.3f%% %15.3f%%\n", "Sorting every value", (t2 - t1) / 1e6, n * sizeof(double) / 1024.0, 0.0, 0.0);
+	free(values);
+	free(sorted);
+	free(total);
+	free(part);
+}
+
+// Measure the pre-trade risk checks on an order, with every limit set and with none, against their budget of 50 ns.
+// Sizes and sides vary so that some orders are rejected by each limit, and the clock moves on so that the message-rate window rolls over.
+void benchmarkRiskChecks() {
+	u32 maxOrderSize = riskMaxOrderSize, priceBand = riskPriceBand, maxMessages = riskMaxMessagesPerSecond;
+	int maxPosition = riskMaxPosition;
+	u64 maxNotional = riskMaxNotional;
+	int n = 10000000;
+
+	printf("%-24s %10s %10s %10s\n", "Risk checks", "ns/order", "Accepted", "Budget");
+	for (int k = 0; k < 2; k++) {
+		riskMaxOrderSize = k == 0 ? 150 : 0;
+		riskMaxNotional = k == 0 ? 60000 : 0;
+		riskPriceBand = k == 0 ? 20 : 0;
+		riskMaxPosition = k == 0 ? 1000 : 0;
+		riskMaxMessagesPerSecond = k == 0 ? 900000 : 0;
+		riskWindowStart = 0;
+		riskWindowMessages = 0;
+		int accepted = 0;
+		u64 t0 = getTime();
+		for (int i = 0; i < n; i++) {
+			bool isBuy = i & 1;
+			u32 p = (isBuy ? ask : bid) + (i % 64) - 32;
+			accepted += riskAccept(isBuy, 1 + i % 200, p, (u64)i * 1000);
+		}
+		u64 t1 = getTime();
+		printf("%-24s %10.2f %9.1f%% %10s\n", k == 0 ? "Every limit set" : "No limits", (double)(t1 - t0) / n, 100.0 * accepted / n, "50.00");
+		benchmarkChecksum += accepted;
+	}
+
+	riskMaxOrderSize = maxOrderSize;
+	riskMaxNotional = maxNotional;
+	riskPriceBand = priceBand;
+	riskMaxPosition = maxPosition;
+	riskMaxMessagesPerSecond = maxMessages;
+	riskWindowStart = 0;
+	riskWindowMessages = 0;
+	numRiskRejects = 0;
+	lastRiskReject = RISK_OK;
+}
+
+// Run every benchmark and print the results.
+void benchmark() {
+	setupMarket(getTime());
+	benchmarkStrategyDispatch();
+	printf("\n");
+	benchmarkRiskChecks();
+	printf("\n");
+	benchmarkWorkloads();
+	printf("\n");
+	benchmarkJitter();
+	printf("\n");
+	benchmarkHugePages();
+	printf("\n");
+	benchmarkLevelRings();
+	printf("\n");
+	benchmarkCompaction();
+	printf("\n");
+	benchmarkBookReaders();
+	printf("\n");
+	benchmarkPipelineGeneration();
+	printf("\n");
+	benchmarkIngress();
+	printf("\n");
+	benchmarkSamplers();
+	printf("\n");
+	benchmarkQuantileSketches();
+}
+
+// SIMULATOR_LIBRARY is defined when this file is built into another program, such as the Python module in python.c.
+#ifndef SIMULATOR_LIBRARY
+int main() {
+	// Pin before allocating so that the pool's pages are placed near the matching CPU.
+	if (matchingCPU >= 0) {
+		pinThread(matchingCPU);
+	}
+	setup();
+	if (strategyPluginPath != NULL) {
+		loadStrategy(strategyPluginPath);
+	}
+	if (runBenchmarks) {
+		benchmark();
+		return 0;
+	}
+	if (backtestListPath != NULL) {
+		runBacktests();
+		return 0;
+	}
+	if (monteCarloSeeds > 0) {
+		runMonteCarlo();
+		return 0;
+	}
+	if (differentialEvents > 0) {
+		runDifferential();
+		return 0;
+	}
+	if (verifyJournalPath != NULL) {
+		return verifyJournal() ? 0 : 1;
+	}
+	if (compareJournalPaths[0] != NULL && compareJournalPaths[1] != NULL) {
+		compareJournals();
+		return 0;
+	}
+
+	u64 startingTime = getTime();
+	setupMarket(startingTime);
+	if (bookReaderThreads > 0) {
+		startBookReaders(bookReaderThreads);
+	}
+	if (journalPath != NULL) {
+		openJournal(startingTime);
+	}
+	if (metricsPort > 0) {
+		startMetricsServer();
+	}
+	if (userScriptPath != NULL) {
+		loadUserScript();
+	}
+
+	mainCycle(startingTime);
+}
+#endif
@@ -0,0 +1,430 @@
+/*
+
+PYTHON MODULE
+
+Builds the simulator as a Python extension module named orderbook, so that runs can be analyzed in Python instead of read off the terminal.
+Everything it returns as an array supports the buffer protocol, so numpy.asarray or memoryview wraps it without copying:
+
+- levels() views the book's own arrays of per-price totals, which change as the simulation runs.
+- run() and monte_carlo() return columns that the simulation wrote straight into memory that the arrays then own.
+
+The simulation runs with the GIL released, so other Python threads keep going during long runs. There is one engine per process,
+so only one call may use it at a time. Errors that end the simulator, such as a market order emptying one side of the book, also end
+the Python process, just as they end a headless run.
+
+Build on Linux with:
+
+	gcc -O2 -shared -fPIC $(python3-config --includes) python.c -o orderbook$(python3-config --extension-suffix) -lm -lpthread -ldl
+
+or on Windows from a Visual Studio prompt with:
+
+	cl /O2 /LD /I<Python>\include python.c /link /LIBPATH:<Python>\libs /OUT:orderbook.pyd
+
+Then:
+
+	import numpy, orderbook
+	orderbook.reset(seed=1)
+	frames = orderbook.run(60)
+	mid = (numpy.asarray(frames["bid"]) + numpy.asarray(frames["ask"])) / 200
+	volume = numpy.asarray(orderbook.levels()["volume"])
+	outcomes = numpy.asarray(orderbook.monte_carlo(1000, seconds=60)[0]) # Points by seeds by mid, spread, depth and PnL.
+
+*/
+
+#define PY_SSIZE_T_CLEAN
+#include <Python.h>
+
+#define SIMULATOR_LIBRARY
+#include "main.c"
+
+// An array over memory that belongs either to the engine or to the array itself.
+typedef struct {
+	PyObject_HEAD
+	void* data;
+	const char* format; // Type of each item, in the struct module's notation.
+	Py_ssize_t itemSize;
+	int ndim;
+	Py_ssize_t shape[3];
+	Py_ssize_t strides[3];
+	bool owned; // Whether data is freed along with the array.
+	bool readonly;
+} engineArray;
+
+static int engineArrayGetBuffer(PyObject* object, Py_buffer* view, int flags) {
+	engineArray* a = (engineArray*)object;
+	if ((flags & PyBUF_WRITABLE) && a->readonly) {
+		PyErr_SetString(PyExc_BufferError, "This array views the live book and is read-only.");
+		view->obj = NULL;
+		return -1;
+	}
+	Py_ssize_t length = a->itemSize;
+	for (int i = 0; i < a->ndim; i++) {
+		length *= a->shape[i];
+	}
+	view->obj = object;
+	Py_INCREF(object);
+	view->buf = a->data;
+	view->len = length;
+	view->readonly = a->readonly;
+	view->itemsize = a->itemSize;
+	view->format = (flags & PyBUF_FORMAT) ? (char*)a->format : NULL;
+	view->ndim = a->ndim;
+	view->shape = (flags & PyBUF_ND) ? a->shape : NULL;
+	view->strides = (flags & PyBUF_STRIDES) == PyBUF_STRIDES ? a->strides : NULL;
+	view->suboffsets = NULL;
+	view->internal = NULL;
+	return 0;
+}
+
+static void engineArrayDealloc(PyObject* object) {
+	engineArray* a = (engineArray*)object;
+	if (a->owned) {
+		free(a->data);
+	}
+	Py_TYPE(object)->tp_free(object);
+}
+
+static PyBufferProcs engineArrayBuffer = { engineArrayGetBuffer, NULL };
+
+static PyTypeObject engineArrayType = {
+	PyVarObject_HEAD_INIT(NULL, 0)
+	.tp_name = "orderbook.EngineArray",
+	.tp_basicsize = sizeof(engineArray),
+	.tp_dealloc = engineArrayDealloc,
+	.tp_as_buffer = &engineArrayBuffer,
+	.tp_flags = Py_TPFLAGS_DEFAULT,
+	.tp_doc = "An array over the simulator's memory. Wrap it with numpy.asarray or memoryview.",
+};
+
+// Wrap data in an array of the given C-contiguous shape. If owned, the array frees data when it is deleted, and it is freed here if that fails.
+static PyObject* newEngineArray(void* data, const char* format, Py_ssize_t itemSize, int ndim, const Py_ssize_t* shape, bool owned) {
+	engineArray* a = PyObject_New(engineArray, &engineArrayType);
+	if (a == NULL) {
+		if (owned) free(data);
+		return NULL;
+	}
+	a->data = data;
+	a->format = format;
+	a->itemSize = itemSize;
+	a->ndim = ndim;
+	a->owned = owned;
+	a->readonly = !owned;
+	Py_ssize_t stride = itemSize;
+	for (int i = ndim - 1; i >= 0; i--) {
+		a->shape[i] = shape[i];
+		a->strides[i] = stride;
+		stride *= shape[i];
+	}
+	return (PyObject*)a;
+}
+
+// Add a new reference to a dictionary under key, dropping it. Return 0 if either failed.
+static bool setItem(PyObject* dict, const char* key, PyObject* value) {
+	if (value == NULL) return 0;
+	int r = PyDict_SetItemString(dict, key, value);
+	Py_DECREF(value);
+	return r == 0;
+}
+
+// Whether a call is using the engine. It is only read and written with the GIL held.
+static bool engineBusy = 0;
+
+static bool claimEngine() {
+	if (engineBusy) {
+		PyErr_SetString(PyExc_RuntimeError, "The simulator is already running in another thread.");
+		return 0;
+	}
+	engineBusy = 1;
+	return 1;
+}
+
+// The session that run() continues.
+static bool sessionStarted = 0;
+static u64 sessionNextOrder = 0;
+static u64 sessionFrame = 0;
+
+static PyObject* pyReset(PyObject* self, PyObject* args, PyObject* kwargs) {
+	static char* keywords[] = { "seed", NULL };
+	unsigned long long s = 1;
+	if (!PyArg_ParseTupleAndKeywords(args, kwargs, "|K", keywords, &s)) return NULL;
+	if (!claimEngine()) return NULL;
+
+	resetBook();
+	sessionSeed = s;
+	setSeed(s);
+	u64 start = 1000000000000ULL;
+	setupMarket(start);
+	startSession(start);
+	sessionNextOrder = start;
+	sessionFrame = start;
+	sessionStarted = 1;
+
+	engineBusy = 0;
+	Py_RETURN_NONE;
+}
+
+// Columns of run(), one row per frame.
+enum { COLUMN_TIME, COLUMN_BID, COLUMN_ASK, COLUMN_BALANCE, COLUMN_SHARES_OPEN, COLUMN_EVENTS, NUM_COLUMNS };
+static const char* columnNames[NUM_COLUMNS] = { "time", "bid", "ask", "balance", "shares_open", "events" };
+static const char* columnFormats[NUM_COLUMNS] = { "Q", "I", "I", "i", "i", "Q" };
+static const Py_ssize_t columnSizes[NUM_COLUMNS] = { sizeof(u64), sizeof(u32), sizeof(u32), sizeof(int), sizeof(int), sizeof(u64) };
+
+static PyObject* pyRun(PyObject* self, PyObject* args) {
+	double seconds;
+	if (!PyArg_ParseTuple(args, "d", &seconds)) return NULL;
+	if (!sessionStarted) {
+		PyErr_SetString(PyExc_RuntimeError, "Start a session with reset() first.");
+		return NULL;
+	}
+	if (seconds < 0) {
+		PyErr_SetString(PyExc_ValueError, "The number of seconds must not be negative.");
+		return NULL;
+	}
+	u64 end = sessionFrame + (u64)(seconds * 1e9);
+	Py_ssize_t frames = (Py_ssize_t)((end - sessionFrame + frameLengthNS - 1) / frameLengthNS);
+	void* columns[NUM_COLUMNS];
+	for (int c = 0; c < NUM_COLUMNS; c++) {
+		columns[c] = malloc((frames > 0 ? frames : 1) * columnSizes[c]);
+		if (columns[c] == NULL) {
+			for (int k = 0; k < c; k++) free(columns[k]);
+			return PyErr_NoMemory();
+		}
+	}
+	if (!claimEngine()) {
+		for (int c = 0; c < NUM_COLUMNS; c++) free(columns[c]);
+		return NULL;
+	}
+
+	Py_BEGIN_ALLOW_THREADS
+	Py_ssize_t row = 0;
+	while (sessionFrame < end) {
+		if (sessionNextOrder < sessionFrame) {
+			participantEvent(&sessionNextOrder);
+		}
+		else {
+			updateFrame(sessionFrame);
+			if (strategyLoaded) {
+				runStrategy(sessionFrame);
+			}
+			compactStep(sessionFrame);
+			((u64*)columns[COLUMN_TIME])[row] = sessionFrame - sessionStartTime;
+			((u32*)columns[COLUMN_BID])[row] = bid;
+			((u32*)columns[COLUMN_ASK])[row] = ask;
+			((int*)columns[COLUMN_BALANCE])[row] = balance;
+			((int*)columns[COLUMN_SHARES_OPEN])[row] = sharesOpen;
+			((u64*)columns[COLUMN_EVENTS])[row] = numEvents;
+			row++;
+			sessionFrame += frameLengthNS;
+		}
+	}
+	Py_END_ALLOW_THREADS
+	engineBusy = 0;
+
+	PyObject* result = PyDict_New();
+	bool ok = result != NULL;
+	for (int c = 0; c < NUM_COLUMNS; c++) {
+		if (ok) {
+			ok = setItem(result, columnNames[c], newEngineArray(columns[c], columnFormats[c], columnSizes[c], 1, &frames, 1));
+		}
+		else {
+			free(columns[c]);
+		}
+	}
+	if (!ok) {
+		Py_XDECREF(result);
+		return NULL;
+	}
+	return result;
+}
+
+// Check the parameter points file the way loadMonteCarloPoints reads it, setting an error instead of ending the process if it
+// can't be opened or a line doesn't hold parameter names each followed by a value.
+static bool checkMonteCarloPoints(const char* path) {
+	FILE* f = fopen(path, "r");
+	if (f == NULL) {
+		PyErr_SetFromErrnoWithFilename(PyExc_OSError, path);
+		return 0;
+	}
+	char line[1024];
+	for (int lineNumber = 1; fgets(line, sizeof(line), f) != NULL; lineNumber++) {
+		line[strcspn(line, "\r\n")] = 0;
+		if (line[0] == '#' || strspn(line, " \t") == strlen(line)) continue;
+		char* name = strtok(line, " \t");
+		while (name != NULL) {
+			char* value = strtok(NULL, " \t");
+			int k = 0;
+			while (k < NUM_MONTE_CARLO_PARAMETERS && strcmp(name, monteCarloParameters[k].name) != 0) k++;
+			if (k == NUM_MONTE_CARLO_PARAMETERS || value == NULL) {
+				PyErr_Format(PyExc_ValueError, "Line %d of %s should hold parameter names each followed by a value.", lineNumber, path);
+				fclose(f);
+				return 0;
+			}
+			name = strtok(NULL, " \t");
+		}
+	}
+	fclose(f);
+	return 1;
+}
+
+static PyObject* pyMonteCarlo(PyObject* self, PyObject* args, PyObject* kwargs) {
+	static char* keywords[] = { "seeds", "seconds", "first_seed", "points", NULL };
+	unsigned int seeds;
+	double seconds = (double)headlessDurationNS / 1e9;
+	unsigned long long firstSeed = 1;
+	const char* points = NULL;
+	if (!PyArg_ParseTupleAndKeywords(args, kwargs, "I|dKz", keywords, &seeds, &seconds, &firstSeed, &points)) return NULL;
+	if (points != NULL && !checkMonteCarloPoints(points)) return NULL;
+	if (!claimEngine()) return NULL;
+
+	// Sessions set the parameters of their point, so put back the ones set with set() afterwards.
+	double saved[NUM_MONTE_CARLO_PARAMETERS];
+	for (int i = 0; i < NUM_MONTE_CARLO_PARAMETERS; i++) {
+		saved[i] = *monteCarloParameters[i].value;
+	}
+	u64 savedDuration = headlessDurationNS;
+	for (int i = 0; i < numMonteCarloPoints; i++) {
+		free((void*)monteCarloPoints[i].text);
+	}
+	free(monteCarloPoints);
+	numMonteCarloPoints = 0;
+	monteCarloPointsPath = (char*)points;
+	loadMonteCarloPoints();
+	monteCarloPointsPath = NULL;
+	headlessDurationNS = (u64)(seconds * 1e9);
+
+	Py_ssize_t shape[3] = { numMonteCarloPoints, seeds, 4 };
+	double* results = (double*)malloc(((size_t)numMonteCarloPoints * seeds * 4 + 1) * sizeof(double));
+	if (results == NULL) {
+		engineBusy = 0;
+		return PyErr_NoMemory();
+	}
+	Py_BEGIN_ALLOW_THREADS
+	for (int point = 0; point < numMonteCarloPoints; point++) {
+		for (u32 i = 0; i < seeds; i++) {
+			monteCarloResult r = runMonteCarloSession(point, firstSeed + i);
+			double* row = &results[((size_t)point * seeds + i) * 4];
+			row[0] = r.mid;
+			row[1] = r.spread;
+			row[2] = r.depth;
+			row[3] = r.pnl;
+		}
+	}
+	Py_END_ALLOW_THREADS
+
+	for (int i = 0; i < NUM_MONTE_CARLO_PARAMETERS; i++) {
+		*monteCarloParameters[i].value = saved[i];
+	}
+	headlessDurationNS = savedDuration;
+
+	// The sessions replaced the book, so leave it empty rather than showing the last one's through state() and levels().
+	resetBook();
+	numEvents = 0;
+	sessionFrame = sessionStartTime;
+	sessionStarted = 0;
+	engineBusy = 0;
+
+	PyObject* array = newEngineArray(results, "d", sizeof(double), 3, shape, 1);
+	PyObject* names = PyList_New(numMonteCarloPoints);
+	if (array == NULL || names == NULL) {
+		Py_XDECREF(array);
+		Py_XDECREF(names);
+		return NULL;
+	}
+	for (int point = 0; point < numMonteCarloPoints; point++) {
+		PyList_SET_ITEM(names, point, PyUnicode_FromString(monteCarloPoints[point].text));
+	}
+	return Py_BuildValue("(NN)", array, names);
+}
+
+static PyObject* pyLevels(PyObject* self, PyObject* noArgs) {
+	Py_ssize_t n = NUM_PRICES;
+	PyObject* result = PyDict_New();
+	if (result == NULL) return NULL;
+	if (!setItem(result, "volume", newEngineArray(levelVolume, "I", sizeof(u32), 1, &n, 0))
+		|| !setItem(result, "orders", newEngineArray(levelOrders, "I", sizeof(u32), 1, &n, 0))
+		|| !setItem(result, "user_orders", newEngineArray(levelUserOrders, "I", sizeof(u32), 1, &n, 0))
+		|| !setItem(result, "min_expiration", newEngineArray(levelMinExpiration, "Q", sizeof(u64), 1, &n, 0))
+		|| !setItem(result, "hash", newEngineArray(levelHash, "Q", sizeof(u64), 1, &n, 0))) {
+		Py_DECREF(result);
+		return NULL;
+	}
+	return result;
+}
+
+static PyObject* pyState(PyObject* self, PyObject* noArgs) {
+	if (!sessionStarted) {
+		PyErr_SetString(PyExc_RuntimeError, "Start a session with reset() first.");
+		return NULL;
+	}
+	return Py_BuildValue("{s:K,s:I,s:I,s:i,s:i,s:K,s:K,s:s}",
+		"time", (unsigned long long)(sessionFrame - sessionStartTime),
+		"bid", bid,
+		"ask", ask,
+		"balance", balance,
+		"shares_open", sharesOpen,
+		"events", (unsigned long long)numEvents,
+		"book_hash", (unsigned long long)bookHash,
+		"phase", phaseText[marketPhase]);
+}
+
+// Find the parameter called name, setting an error if there is none.
+static double* findParameter(const char* name) {
+	for (int i = 0; i < NUM_MONTE_CARLO_PARAMETERS; i++) {
+		if (strcmp(name, monteCarloParameters[i].name) == 0) return monteCarloParameters[i].value;
+	}
+	PyErr_Format(PyExc_KeyError, "No parameter is called %s.", name);
+	return NULL;
+}
+
+static PyObject* pySet(PyObject* self, PyObject* args) {
+	const char* name;
+	double value;
+	if (!PyArg_ParseTuple(args, "sd", &name, &value)) return NULL;
+	double* p = findParameter(name);
+	if (p == NULL) return NULL;
+	if (engineBusy) {
+		PyErr_SetString(PyExc_RuntimeError, "Parameters cannot change while the simulator is running.");
+		return NULL;
+	}
+	*p = value;
+	Py_RETURN_NONE;
+}
+
+static PyObject* pyGet(PyObject* self, PyObject* args) {
+	const char* name;
+	if (!PyArg_ParseTuple(args, "s", &name)) return NULL;
+	double* p = findParameter(name);
+	if (p == NULL) return NULL;
+	return PyFloat_FromDouble(*p);
+}
+
+static PyMethodDef orderbookMethods[] = {
+	{ "reset", (PyCFunction)(void (*)(void))pyReset, METH_VARARGS | METH_KEYWORDS,
+		"reset(seed=1)\n\nEmpty the book and start a new session from seed." },
+	{ "run", pyRun, METH_VARARGS,
+		"run(seconds)\n\nContinue the session for that much simulated time. Returns a dict of arrays with one item per frame: "
+		"time (ns since the start), bid, ask (cents), balance (cents), shares_open and events (participant orders so far)." },
+	{ "monte_carlo", (PyCFunction)(void (*)(void))pyMonteCarlo, METH_VARARGS | METH_KEYWORDS,
+		"monte_carlo(seeds, seconds=60, first_seed=1, points=None)\n\nRun seeds sessions from consecutive seeds at each parameter point, "
+		"as in a Monte Carlo run. points is a file of parameter points, or None for the current parameters. Returns an array of "
+		"points by seeds by (mid, spread, depth, PnL) in cents and shares, and the list of points. The current session ends, leaving the book empty until reset()." },
+	{ "levels", pyLevels, METH_NOARGS,
+		"levels()\n\nRead-only arrays over the book's totals at every price: volume, orders, user_orders, min_expiration and hash. "
+		"They are the engine's own memory, so they always show the current book." },
+	{ "state", pyState, METH_NOARGS, "state()\n\nThe time, bid, ask, balance, shares open, events, book fingerprint and phase of the session started with reset()." },
+	{ "set", pySet, METH_VARARGS, "set(name, value)\n\nSet a participant parameter, such as marketOrderProbability." },
+	{ "get", pyGet, METH_VARARGS, "get(name)\n\nThe value of a participant parameter." },
+	{ NULL, NULL, 0, NULL }
+};
+
+static struct PyModuleDef orderbookModule = {
+	PyModuleDef_HEAD_INIT, "orderbook", "The order book market simulator, with its book and results as arrays.", -1, orderbookMethods
+};
+
+PyMODINIT_FUNC PyInit_orderbook(void) {
+	if (PyType_Ready(&engineArrayType) < 0) return NULL;
+	PyObject* module = PyModule_Create(&orderbookModule);
+	if (module == NULL) return NULL;
+	setup();
+	return module;
+}
@@ -0,0 +1,96 @@
+/*
+
+STRATEGY PLUGINS
+
+A strategy is a shared library (.so or .dll) that trades as the user from inside the simulator.
+The simulator loads it with dlopen or LoadLibrary and calls its exported strategyLoad function once.
+The plugin fills in its callbacks and keeps the book view and API pointers it is given.
+
+The book view points straight into the simulator's own state, so reading it copies nothing and is always current.
+It must only be read from inside a callback, since the book changes between them.
+The bid and ask are updated lazily, so the levels they point to may be empty.
+
+Orders sent through the API go through the same risk checks, latency and gateway as the user's orders.
+They are sent after the callback returns. Limit orders are post-only and are dropped if they would cross when they arrive.
+
+A minimal plugin:
+
+	#include "strategy.h"
+
+	static const strategyApi* api;
+
+	static void onTopOfBook(void* state, unsigned int bid, unsigned int ask) {
+		if (ask - bid > 2) api->limitBuy(bid + 1, 10);
+	}
+
+	STRATEGY_EXPORT bool strategyLoad(int version, const bookView* view, const strategyApi* a, strategyCallbacks* callbacks) {
+		if (version != STRATEGY_API_VERSION) return 0;
+		api = a;
+		callbacks->onTopOfBook = onTopOfBook;
+		return 1;
+	}
+
+*/
+
+#ifndef STRATEGY_H
+#define STRATEGY_H
+
+#include <stdbool.h>
+
+// Plugins must be rebuilt whenever this changes.
+#define STRATEGY_API_VERSION 2
+
+#if defined(_WIN32)
+#define STRATEGY_EXPORT __declspec(dllexport)
+#else
+#define STRATEGY_EXPORT __attribute__((visibility("default")))
+#endif
+
+// A limit order waiting to be filled.
+typedef struct limitOrder {
+	unsigned int size;
+	unsigned int p;
+	unsigned long long expirationTime; // The time at which this order gets deleted.
+	struct limitOrder* next; // Next order at the exact same price (singly-linked list).
+	bool user; // Whether this limit order was created by the user.
+	unsigned int id; // Numbers orders in the order they were sent, starting from 1.
+} limitOrder;
+
+// Read-only view of the live book.
+typedef struct {
+	const limitOrder* const* levels; // The first order to be filled at each price, from 0 to numPrices - 1.
+	unsigned int numPrices;
+	const unsigned int* bid;
+	const unsigned int* ask;
+	const int* balance; // The user's cash in cents.
+	const int* sharesOpen; // The user's position.
+	const limitOrder* const* userLimitOrders; // The user's resting limit orders.
+	const int* numUserLimitOrders;
+	const int* marketPhase;
+} bookView;
+
+// Functions for sending orders as the user. They return 0 if the order was rejected before being sent.
+typedef struct {
+	bool (*marketBuy)(unsigned int size);
+	bool (*marketSell)(unsigned int size);
+	bool (*limitBuy)(unsigned int p, unsigned int size);
+	bool (*limitSell)(unsigned int p, unsigned int size);
+	void (*cancelAll)(void);
+	unsigned long long (*now)(void); // The simulated time in nanoseconds.
+} strategyApi;
+
+// Callbacks from the simulator. Any of them may be left NULL.
+typedef struct {
+	void (*onFill)(void* state, unsigned int p, unsigned int size, bool isBuy); // One of the user's orders traded at price p.
+	void (*onTopOfBook)(void* state, unsigned int bid, unsigned int ask); // The bid or ask moved.
+	void (*onTimer)(void* state, unsigned long long t); // Called every timerIntervalNS of simulated time.
+	void (*onUnload)(void* state);
+	unsigned long long timerIntervalNS; // 0 for no timer.
+	void* state; // Passed back to every callback.
+} strategyCallbacks;
+
+// The function every plugin exports. Return 0 to refuse to load.
+typedef bool (*strategyLoadFunction)(int version, const bookView* view, const strategyApi* api, strategyCallbacks* callbacks);
+#define STRATEGY_LOAD_SYMBOL "strategyLoad"
+
+#endif